@@ -14,9 +14,11 @@
 #include "../common/UART0int.h"
 #include "../common/eDisk.h"
 #include "../common/eFile.h"
+#include "../common/heap.h"
 #include "../inc/ADCT0ATrigger.h"
 #include "../inc/ADCSWTrigger.h"
 #include "../deadlock/loader.h"
+#include "../deadlock/bankers.h"
 
 extern uint32_t DataLost;
 extern int32_t MaxJitter;
@@ -295,6 +297,18 @@ void executeCommand(char **tokens, int tokenCount)
             }
         }
     }
+    else if (strcmp(command, "bankers_trace") == 0)
+    {
+        Bankers_TraceDump();
+    }
+    else if (strcmp(command, "heap") == 0)
+    {
+        Heap_Dump();
+    }
+    else if (strcmp(command, "stacks") == 0)
+    {
+        OS_StackDump();
+    }
     else
     {
         // Unknown command
@@ -345,6 +359,9 @@ void Interpreter(void)
         UART_OutString("format\r\n");
         UART_OutString("unmount\r\n");
         UART_OutString("load_elf [file_name]\r\n");
+        UART_OutString("bankers_trace\r\n");
+        UART_OutString("heap\r\n");
+        UART_OutString("stacks\r\n");
         OutCRLF();
         UART_InString(command, BUFFER_LEN);
         int tokenCount = tokenize(command, tokens, MAX_TOKENS);
@@ -10,6 +10,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "../common/ST7735.h"
 #include "../common/UART0int.h"
@@ -26,6 +27,9 @@
 #include "../inc/Timer4A.h"
 #include "../inc/WTimer0A.h"
 #include "../inc/tm4c123gh6pm.h"
+#if (OS_HOSTED)
+#include "../host/OShost.h"
+#endif
 
 // ASM Function Declarations
 void ContextSwitch(void);
@@ -80,6 +84,15 @@ uint32_t MaxCritical = 0;
     }
 #endif
 
+#define MEASURE_DEADLOCK 1
+uint32_t DeadlocksFound = 0;
+uint32_t DeadlockVictims = 0;  // threads killed or aborted to break deadlocks
+uint32_t DeadlockAborts = 0;   // victims whose wait was aborted instead
+uint32_t DeadlockLatency = 0;  // ms between the cycle closing and its detection, last deadlock
+uint32_t DeadlockChecks = 0;
+uint32_t DeadlockCheckSum = 0;
+uint32_t DeadlockCheckMax = 0;
+
 volatile uint32_t IdleCountRef = 0;
 
 // TCBs
@@ -87,14 +100,62 @@ uint32_t num_created = 0;
 uint32_t num_killed = 0;
 TCB *RunPt = NULL;
 TCB *NextPt = NULL;
-TCB tcb_pool[MAX_THREADS];
-uint32_t stack_pool[MAX_THREADS][STACK_SIZE];
+
+// Thread stacks
+// Each thread owns one chunk of stack_arena, its TCB followed by its stack.
+// A chunk is carved off the arena the first time a stack of its size is
+// asked for and goes on the free list of its size once its thread is
+// killed, so adding and killing threads take constant time and only the
+// threads that exist use RAM. A thread that kills itself runs on its stack
+// until the switch away from it, so its chunk is given back after that.
+#define TCB_WORDS ((sizeof(TCB) + 7) / 8 * 2)  // keeps the stack after the TCB 8 byte aligned
+#define STACK_CLASSES (STACK_MAX_WORDS / STACK_MIN_WORDS)
+
+uint64_t stack_arena[STACK_ARENA_WORDS / 2];
+uint32_t stack_arena_used;       // words carved off stack_arena
+TCB *stack_free[STACK_CLASSES];  // chunks of killed threads by stack size, linked through next
+TCB *Zombie;                     // killed itself, its chunk is still in use while it is RunPt
+
+// Stack checks
+// Stacks are painted with STACK_CANARY below their initial frame. The MPU
+// guard is the lowest 32 byte aligned block of the stack, the host stacks
+// are not in the arena and have none.
+#define STACK_MPU (STACK_GUARD && !OS_HOSTED)
+#if (STACK_MPU)
+#define STACK_GUARD_REGION 7  // MPU region, the highest wins where regions overlap
+#define STACK_GUARD_WORDS 16  // the 8 word region and up to 7 words below it to align it
+#else
+#define STACK_GUARD_WORDS 0
+#endif
+#if (STACK_CHECK)
+uint32_t StackOverflows;  // switches away from a thread whose bottom stack word was overwritten
+int32_t StackOverflowId;  // id of the last such thread, -1 if none
+#endif
+
+// Thread ids
+TCB *tcb_table[MAX_THREADS];    // TCB of each thread id, NULL while the id is free
+uint8_t free_ids[MAX_THREADS];  // stack of the free ids
+uint32_t num_free_ids;
 
 // PCBs
 PCB pcb_pool[MAX_PROCESSES];
 
+// Free PCBs, whose status is DEAD
+PoolType PcbPool;
+
+// Queues initialized since OS_Init, newest first
+QueueType *Queues;
+
 // Priority Lists
 TCB *PriorityPts[PRIORITY_LEVELS];
+uint32_t ReadyBits;  // bit (31 - priority) is set while PriorityPts[priority] is not empty
+#if (READY_BITMAP)
+// Threads in OS_Sleep, kept out of the priority lists and sorted by wake time.
+// Each sleepCount is a delta: the ms left after the thread before it wakes.
+TCB *SleepPt;
+#endif
+// Threads in OS_WaitTimeout that can expire, delta list like SleepPt
+TCB *TimeoutPt;
 
 // Adds an element to the end of the list and returns the head
 TCB *tcb_list_add(TCB *head, TCB *elem) {
@@ -130,13 +191,190 @@ TCB *tcb_list_remove(TCB *head) {
     return head->next;
 }
 
+// Adds a thread to the end of its priority list
+void ready_list_add(TCB *thread) {
+    PriorityPts[thread->priority] = tcb_list_add(PriorityPts[thread->priority], thread);
+    ReadyBits |= (0x80000000 >> thread->priority);
+}
+
+// Removes a thread from its priority list
+// If it was the head, the head moves back one so OS_Suspend's rotation
+// lands on the thread that followed it
+void ready_list_remove(TCB *thread) {
+    TCB *next = tcb_list_remove(thread);
+    if (next == NULL) {
+        PriorityPts[thread->priority] = NULL;
+        ReadyBits &= ~(0x80000000 >> thread->priority);
+    } else if (PriorityPts[thread->priority] == thread) {
+        PriorityPts[thread->priority] = next->prev;
+    }
+}
+
+#if (READY_BITMAP)
+// Inserts a thread into the sleep queue
+// Threads with the same wake time stay in the order they went to sleep
+void sleep_list_insert(TCB *thread, uint32_t sleepTime) {
+    TCB *curr = SleepPt;
+    if (curr != NULL) {
+        do {
+            if (sleepTime < curr->sleepCount) {
+                // Wakes before curr, which now only waits for the difference
+                curr->sleepCount -= sleepTime;
+                thread->sleepCount = sleepTime;
+                tcb_list_add(curr, thread);  // links thread in front of curr
+                if (curr == SleepPt) {
+                    SleepPt = thread;
+                }
+                return;
+            }
+            sleepTime -= curr->sleepCount;
+            curr = curr->next;
+        } while (curr != SleepPt);
+    }
+    thread->sleepCount = sleepTime;
+    SleepPt = tcb_list_add(SleepPt, thread);
+}
+
+// Removes a thread from the sleep queue before it wakes up
+void sleep_list_remove(TCB *thread) {
+    if (thread->next != SleepPt) {
+        // Successor inherits the remaining delta
+        thread->next->sleepCount += thread->sleepCount;
+    }
+    TCB *next = tcb_list_remove(thread);
+    if (thread == SleepPt) {
+        SleepPt = next;
+    }
+}
+#endif
+
+// Inserts a thread into the timed wait list, timeout > 0
+void timeout_list_insert(TCB *thread, uint32_t timeout) {
+    TCB **link = &TimeoutPt;
+    while (*link != NULL && (*link)->timeoutCount <= timeout) {
+        timeout -= (*link)->timeoutCount;
+        link = &(*link)->timeoutNext;
+    }
+    if (*link != NULL) {
+        (*link)->timeoutCount -= timeout;
+    }
+    thread->timeoutCount = timeout;
+    thread->timeoutNext = *link;
+    *link = thread;
+    thread->timed = 1;
+}
+
+// Removes a thread from the timed wait list before it expires
+void timeout_list_remove(TCB *thread) {
+    TCB **link = &TimeoutPt;
+    while (*link != thread) {
+        link = &(*link)->timeoutNext;
+    }
+    *link = thread->timeoutNext;
+    if (thread->timeoutNext != NULL) {
+        // Successor inherits the remaining delta
+        thread->timeoutNext->timeoutCount += thread->timeoutCount;
+    }
+    thread->timed = 0;
+}
+
+#if (LOCK_PRIORITY_INHERITANCE)
+// Moves a thread to another priority in whichever list it is in
+void thread_set_priority(TCB *thread, uint32_t priority) {
+    if (thread->status == BLOCKED) {
+        // Keep the semaphore waking it in priority order
+        Sema4Type *semaPt = thread->SemaPt;
+        TCB *next = tcb_list_remove(thread);
+        if (thread == semaPt->BlockedPts[thread->priority]) {
+            semaPt->BlockedPts[thread->priority] = next;
+        }
+        thread->priority = priority;
+        semaPt->BlockedPts[priority] = tcb_list_add(semaPt->BlockedPts[priority], thread);
+#if (READY_BITMAP)
+    } else if (thread->status == SLEEPING) {
+        thread->priority = priority;
+#endif
+    } else {
+        ready_list_remove(thread);
+        thread->priority = priority;
+        ready_list_add(thread);
+        if (thread == RunPt) {
+            PriorityPts[priority] = thread;  // OS_Suspend rotates past the running thread
+        }
+    }
+}
+
+// Recomputes the priority of a Lock holder from its own and that of the
+// highest priority waiter on any Lock it holds. A change is passed on to
+// the holder of the Lock it waits for in turn. Interrupts must be disabled.
+void priority_inherit(TCB *thread) {
+    for (uint32_t steps = 0; thread != NULL && steps < MAX_THREADS; steps++) {
+        uint32_t priority = thread->basePriority;
+        for (Lock *lock = thread->acquired; lock != NULL; lock = lock->next) {
+            for (uint32_t p = 0; p < priority; p++) {
+                if (lock->sema.BlockedPts[p] != NULL) {
+                    priority = p;
+                    break;
+                }
+            }
+        }
+        if (priority == thread->priority) {
+            return;
+        }
+        thread_set_priority(thread, priority);
+        thread = (thread->status == BLOCKED && thread->LockPt != NULL) ? thread->LockPt->holder : NULL;
+    }
+}
+#endif
+
+// Takes a blocked thread off its semaphore without it being signalled,
+// the count it was waiting for is given back. Interrupts must be disabled.
+void sema_queue_remove(TCB *thread) {
+    Sema4Type *semaPt = thread->SemaPt;
+    TCB *next = tcb_list_remove(thread);
+    if (thread == semaPt->BlockedPts[thread->priority]) {
+        semaPt->BlockedPts[thread->priority] = next;
+    }
+    semaPt->Value += 1;
+    thread->SemaPt = NULL;
+    if (thread->timed) {
+        timeout_list_remove(thread);
+    }
+#if (LOCK_PRIORITY_INHERITANCE)
+    if (thread->LockPt != NULL) {
+        priority_inherit(thread->LockPt->holder);  // may no longer need a boost
+    }
+#endif
+}
+
+// Ends the wait of a thread blocked in OS_WaitTimeout with result
+void sema_wait_abort(TCB *thread, int32_t result) {
+    sema_queue_remove(thread);
+#if (DEADLOCK_DETECTION)
+    thread->LockPt = NULL;
+#endif
+    thread->waitResult = result;
+    thread->status = ACTIVE;
+    ready_list_add(thread);
+}
+
 // Fifo
-#define FIFOSIZE 32
+uint32_t volatile Fifo[FIFO_MAX_SIZE];
+uint32_t FifoSize;  // power of 2 set by OS_Fifo_Init
+#if (FIFO_LOCKFREE)
+// Free running indices, the slot is the index modulo FifoSize. Only the
+// producer writes FifoPut, after the data it publishes, and only the
+// consumer writes FifoGet, after reading the data of the slots it frees.
+uint32_t volatile FifoPut;
+uint32_t volatile FifoGet;
+uint32_t volatile FifoWaiting;  // the consumer found the Fifo empty and waits on FifoData
+Sema4Type FifoData;
+#else
 Sema4Type CurrentSize;
 Sema4Type FIFOmutex;       // exclusive access to FIFO
 uint32_t volatile *PutPt;  // put next
 uint32_t volatile *GetPt;  // get next
-uint32_t static Fifo[FIFOSIZE];
+#endif
 
 // Mailbox
 Sema4Type BoxFree;
@@ -170,56 +408,239 @@ void Timer2Calibrate() {
 void Timer2Dummy() {}
 
 #if (DEADLOCK_DETECTION)
-int CheckForDeadlocks(TCB *thread) {
-#if (DEADLOCK_PRINTS)
-    printf("checking for deadlocks starting from thread %d\r\n", thread->id);
-#endif
+// Wait-for graph
+// A blocked thread waits either for one thread, the holder of its Lock or of
+// the binary semaphore it is in OS_bWait on, or for any one of the producers
+// of its counting semaphore (FIFO, mailbox, bankers blocked). A wait nothing
+// is known about, or that an interrupt handler can end, is never deadlocked.
+// Threads that exited count as able to run, their id may be reused.
+
+// Returns 1 if every thread that can end thread's wait is marked visited
+int deadlock_wakers_visited(TCB *thread) {
+    Sema4Type *semaPt = thread->SemaPt;
+    if (thread->LockPt != NULL || semaPt->holder != NULL) {
+        TCB *holder = (thread->LockPt != NULL) ? thread->LockPt->holder : semaPt->holder;
+        return holder != NULL && holder->visited;
+    }
+    if (semaPt->background) {
+        return 0;
+    }
+    int known = 0;
+    for (uint32_t w = 0; w < (MAX_THREADS + 31) / 32; w++) {
+        uint32_t bits = semaPt->producers[w];
+        while (bits != 0) {
+            TCB *producer = tcb_table[w * 32 + __builtin_ctz(bits)];
+            if (producer == NULL || !producer->visited) {
+                return 0;  // an id given to a new thread since may signal too
+            }
+            bits &= bits - 1;
+            known = 1;
+        }
+    }
+    return known;
+}
+
+// Returns a thread that thread waits for, with marks from DeadlockMark it is deadlocked too
+TCB *deadlock_next(TCB *thread) {
+    if (thread->LockPt != NULL) {
+        return thread->LockPt->holder;
+    }
+    if (thread->SemaPt->holder != NULL) {
+        return thread->SemaPt->holder;
+    }
+    for (uint32_t w = 0; w < (MAX_THREADS + 31) / 32; w++) {
+        if (thread->SemaPt->producers[w] != 0) {
+            return tcb_table[w * 32 + __builtin_ctz(thread->SemaPt->producers[w])];
+        }
+    }
+    return NULL;
+}
+
+// Marks the deadlocked threads as visited: blocked threads that only marked
+// threads can wake. Starts from all blocked threads and unmarks any that an
+// unmarked thread can wake until nothing changes. Interrupts must be disabled.
+void DeadlockMark(void) {
     for (uint32_t tid = 0; tid < MAX_THREADS; tid++) {
-        tcb_pool[tid].visited = 0;
+        if (tcb_table[tid] != NULL) {
+            tcb_table[tid]->visited = (tcb_table[tid]->status == BLOCKED);
+        }
     }
-    TCB *curr = thread;
-    int found_cycle = 0;
-    while (curr != NULL &&
-           curr->status == BLOCKED &&
-           curr->LockPt != NULL) {
-        if (curr->visited) {
-            found_cycle = 1;
-            break;
+    int changed;
+    do {
+        changed = 0;
+        for (uint32_t tid = 0; tid < MAX_THREADS; tid++) {
+            TCB *thread = tcb_table[tid];
+            if (thread != NULL && thread->visited && !deadlock_wakers_visited(thread)) {
+                thread->visited = 0;
+                changed = 1;
+            }
         }
-        curr->visited = 1;
-        curr = curr->LockPt->holder;
+    } while (changed);
+}
+
+// Victim policies, lower cost is killed first
+uint32_t VictimPriority(uint32_t tid) {
+    return PRIORITY_LEVELS - 1 - tcb_table[tid]->priority;
+}
+
+uint32_t VictimYoungest(uint32_t tid) {
+    return OS_MsTime() - tcb_table[tid]->lockStart;
+}
+
+uint32_t VictimFewestLocks(uint32_t tid) {
+    uint32_t count = 0;
+    for (Lock *lock = tcb_table[tid]->acquired; lock != NULL; lock = lock->next) {
+        count++;
+    }
+    for (Sema4Type *semaPt = tcb_table[tid]->held; semaPt != NULL; semaPt = semaPt->next) {
+        count++;
     }
+    return count;
+}
 
-    if (found_cycle) {
+#if (DEADLOCK_VICTIM == VICTIM_PRIORITY)
+#define VICTIM_COST VictimPriority
+#elif (DEADLOCK_VICTIM == VICTIM_YOUNGEST)
+#define VICTIM_COST VictimYoungest
+#elif (DEADLOCK_VICTIM == VICTIM_FEWEST_LOCKS)
+#define VICTIM_COST VictimFewestLocks
+#else
+#define VICTIM_COST NULL
+#endif
+uint32_t (*VictimCost)(uint32_t tid) = VICTIM_COST;
+
+void OS_DeadlockVictimCost(uint32_t (*cost)(uint32_t tid)) {
+    VictimCost = (cost != NULL) ? cost : VICTIM_COST;
+}
+
+// Breaks the deadlock thread is part of, killing one thread of the cycle
+// reached from it at a time (all of them with VICTIM_ALL) until thread is
+// no longer deadlocked. Kills are done with interrupts disabled, so if the
+// running thread is a victim the switch away from it happens on exit.
+void DeadlockRecover(TCB *thread) {
+    int32_t sr;
+    OSCRITICAL_ENTER();
+    DeadlocksFound++;
+    do {
+        // thread may only lead into the cycle, after MAX_THREADS steps we are on it
+        TCB *start = thread;
+        for (uint32_t steps = 0; steps < MAX_THREADS; steps++) {
+            start = deadlock_next(start);
+        }
+        TCB *curr = start;
+        TCB *victim = NULL;
+        uint32_t closed = 0;
 #if (DEADLOCK_PRINTS)
         printf("detected cycle: ");
 #endif
-        thread = curr;
         do {
 #if (DEADLOCK_PRINTS)
             printf("%d -> ", curr->id);
 #endif
-            OS_Kill_Thread(curr->id);
-            curr = curr->LockPt->holder;
-        } while (curr != thread);
+            // The cycle closed when its last member started waiting
+            if ((int32_t)(curr->lockStart - closed) > 0) {
+                closed = curr->lockStart;
+            }
+            // Aborting a wait is cheaper than any kill
+            if (victim == NULL || (curr->abortable && !victim->abortable) ||
+                (curr->abortable == victim->abortable && VictimCost != NULL &&
+                 VictimCost(curr->id) < VictimCost(victim->id))) {
+                victim = curr;
+            }
+            curr->visited = 2;
+            curr = deadlock_next(curr);
+        } while (curr != start);
 #if (DEADLOCK_PRINTS)
         printf("%d\r\n", curr->id);
-        printf("killed all threads in cycle\r\n");
 #endif
+        DeadlockLatency = OS_MsTime() - closed;
+
+        if (VictimCost != NULL) {
+            DeadlockVictims++;
+            if (victim->abortable) {
+#if (DEADLOCK_PRINTS)
+                printf("aborting wait of thread %d\r\n", victim->id);
+#endif
+                DeadlockAborts++;
+                sema_wait_abort(victim, OS_WAIT_DEADLOCK);
+            } else {
+#if (DEADLOCK_PRINTS)
+                printf("killing thread %d\r\n", victim->id);
+#endif
+                OS_Kill_Thread(victim->id);
+            }
+        } else {
+            // Killing hands locks and semaphores over to waiters, which changes
+            // the graph, so the cycle is marked first
+            for (uint32_t tid = 0; tid < MAX_THREADS; tid++) {
+                if (tcb_table[tid] != NULL && tcb_table[tid]->visited == 2) {
+                    DeadlockVictims++;
+                    if (tcb_table[tid]->abortable) {
+                        DeadlockAborts++;
+                        sema_wait_abort(tcb_table[tid], OS_WAIT_DEADLOCK);
+                    } else {
+                        OS_Kill_Thread(tid);
+                    }
+                }
+            }
+#if (DEADLOCK_PRINTS)
+            printf("killed all threads in cycle\r\n");
+#endif
+        }
+        DeadlockMark();
+    } while (tcb_table[thread->id] == thread && thread->visited);  // thread may have been killed
+    OSCRITICAL_EXIT();
+}
+
+int CheckForDeadlocks(TCB *thread) {
+#if (DEADLOCK_PRINTS)
+    printf("checking for deadlocks starting from thread %d\r\n", thread->id);
+#endif
+    int32_t sr;
+    OSCRITICAL_ENTER();
+    DeadlockMark();
+    int found_cycle = thread->visited;
+    if (found_cycle) {
+        DeadlockRecover(thread);
     }
+    OSCRITICAL_EXIT();
 
     return found_cycle;
 }
 
+#if (DEADLOCK_INCREMENTAL)
+// Checks whether thread, which has just blocked, closes a cycle in the wait-for graph
+// Every earlier wait was checked when it started, so a new deadlock has to
+// include thread. Chains of single holders are followed directly, the full
+// marking is only needed once the chain reaches a wait on producers.
+// Interrupts must be disabled.
+int DeadlockClosesCycle(TCB *thread) {
+    TCB *curr = thread;
+    for (uint32_t steps = 0; steps < MAX_THREADS; steps++) {
+        if (curr->LockPt == NULL && curr->SemaPt->holder == NULL) {
+            DeadlockMark();
+            return thread->visited;
+        }
+        curr = deadlock_next(curr);
+        if (curr == thread) {
+            return 1;
+        }
+        if (curr == NULL || curr->status != BLOCKED) {
+            return 0;
+        }
+    }
+    return 0;
+}
+#endif
+
 #define PD1 (*((volatile uint32_t *)0x40007008))
 void DeadlockTask() {
     // PD1 ^= 0x02;
     for (uint32_t tid = 0; tid < MAX_THREADS; tid++) {
-        if (tcb_pool[tid].status == BLOCKED &&
-            tcb_pool[tid].LockPt != NULL &&
-            ((int32_t)(OS_MsTime() - tcb_pool[tid].lockStart)) > DEADLOCK_CHECK_PERIOD_MS) {
-            // Thread has been waiting for a lock for over 3 seconds -- check for cycle
-            if (CheckForDeadlocks(&tcb_pool[tid])) {
+        if (tcb_table[tid] != NULL && tcb_table[tid]->status == BLOCKED &&
+            ((int32_t)(OS_MsTime() - tcb_table[tid]->lockStart)) > DEADLOCK_CHECK_PERIOD_MS) {
+            // Thread has been waiting for a lock or semaphore for over 3 seconds -- check for cycle
+            if (CheckForDeadlocks(tcb_table[tid])) {
                 break;
             }
         }
@@ -239,11 +660,21 @@ void DeadlockTask() {
 void OS_Init(void) {
     PLL_Init(Bus80MHz);
     LaunchPad_Init();
+#if (OS_HOSTED)
+    Host_Init();
+#else
     Timer2A_Init(&Timer2Calibrate, TIME_1MS * 10, 7);
     while (!calibrate_flag) {
         IdleCountRef++;
     }
     Timer2A_Init(&Timer2Dummy, 0xFFFFFFFF, 7);
+#if (OS_FPU)
+    // Threads get the FPU, with S0-S15 stacked only once a handler uses it.
+    // PendSV saves S16-S31 of the threads that used it.
+    NVIC_CPAC_R |= 0x00F00000;  // full access to CP10 and CP11
+    NVIC_FPCC_R |= NVIC_FPCC_ASPEN | NVIC_FPCC_LSPEN;
+#endif
+#endif
     UART_Init();
     ST7735_InitR(INITR_REDTAB);
     Heap_Init();
@@ -257,6 +688,27 @@ void OS_Init(void) {
     for (uint32_t i = 0; i < PRIORITY_LEVELS; i++) {
         PriorityPts[i] = NULL;
     }
+    ReadyBits = 0;
+#if (READY_BITMAP)
+    SleepPt = NULL;
+#endif
+    TimeoutPt = NULL;
+    for (uint32_t i = 0; i < MAX_THREADS; i++) {
+        tcb_table[i] = NULL;
+        free_ids[i] = MAX_THREADS - 1 - i;  // lowest id first
+    }
+    num_free_ids = MAX_THREADS;
+    for (uint32_t i = 0; i < STACK_CLASSES; i++) {
+        stack_free[i] = NULL;
+    }
+    stack_arena_used = 0;
+    Zombie = NULL;
+#if (STACK_CHECK)
+    StackOverflows = 0;
+    StackOverflowId = -1;
+#endif
+    OS_PoolInitArray(&PcbPool, pcb_pool);
+    Queues = NULL;
 };
 
 // ******** OS_InitSemaphore ************
@@ -268,8 +720,52 @@ void OS_InitSemaphore(Sema4Type *semaPt, int32_t value) {
     for (uint32_t i = 0; i < PRIORITY_LEVELS; i++) {
         semaPt->BlockedPts[i] = NULL;
     }
+#if (DEADLOCK_DETECTION)
+    semaPt->holder = NULL;
+    semaPt->next = NULL;
+    for (uint32_t w = 0; w < (MAX_THREADS + 31) / 32; w++) {
+        semaPt->producers[w] = 0;
+    }
+    semaPt->background = 0;
+#endif
 };
 
+// Blocks the running thread on semaPt, whose count it already took
+// Interrupts must be disabled, the caller has to OS_Suspend afterwards
+void sema_block(Sema4Type *semaPt) {
+    RunPt->status = BLOCKED;
+    RunPt->SemaPt = semaPt;
+    // Remove thread from priority lists
+    ready_list_remove(RunPt);
+    // Add thread to semaphore blocked lists
+    semaPt->BlockedPts[RunPt->priority] = tcb_list_add(semaPt->BlockedPts[RunPt->priority], RunPt);
+#if (LOCK_PRIORITY_INHERITANCE)
+    if (RunPt->LockPt != NULL) {
+        priority_inherit(RunPt->LockPt->holder);
+    }
+#endif
+#if (DEADLOCK_DETECTION)
+    RunPt->lockStart = OS_MsTime();
+#if (DEADLOCK_INCREMENTAL)
+#if (MEASURE_DEADLOCK)
+    uint32_t start = OS_Time();
+#endif
+    int cycle = DeadlockClosesCycle(RunPt);
+#if (MEASURE_DEADLOCK)
+    uint32_t check = OS_TimeDifference(start, OS_Time());
+    DeadlockChecks++;
+    DeadlockCheckSum += check;
+    if (check > DeadlockCheckMax) {
+        DeadlockCheckMax = check;
+    }
+#endif
+    if (cycle) {
+        DeadlockRecover(RunPt);
+    }
+#endif
+#endif
+}
+
 // ******** OS_Wait ************
 // decrement semaphore
 // Lab2 spinlock
@@ -281,15 +777,7 @@ void OS_Wait(Sema4Type *semaPt) {
     OSCRITICAL_ENTER();
     semaPt->Value -= 1;
     if (semaPt->Value < 0) {
-        RunPt->status = BLOCKED;
-        RunPt->SemaPt = semaPt;
-        // Remove thread from priority lists
-        PriorityPts[RunPt->priority] = tcb_list_remove(RunPt);
-        if (PriorityPts[RunPt->priority] != NULL) {
-            PriorityPts[RunPt->priority] = PriorityPts[RunPt->priority]->prev;
-        }
-        // Add thread to semaphore blocked lists
-        semaPt->BlockedPts[RunPt->priority] = tcb_list_add(semaPt->BlockedPts[RunPt->priority], RunPt);
+        sema_block(semaPt);
         OSCRITICAL_EXIT();
         OS_Suspend();  // Force context switch
         OSCRITICAL_ENTER();
@@ -297,15 +785,45 @@ void OS_Wait(Sema4Type *semaPt) {
     OSCRITICAL_EXIT();
 };
 
-// ******** OS_Signal ************
-// increment semaphore
-// Lab2 spinlock
-// Lab3 wakeup blocked thread if appropriate
-// input:  pointer to a counting semaphore
-// output: none
-void OS_Signal(Sema4Type *semaPt) {
+// ******** OS_WaitTimeout ************
+// decrement semaphore, blocking for at most timeout ms
+// input:  pointer to a counting semaphore, timeout in ms
+// output: OS_WAIT_OK, OS_WAIT_TIMEOUT or OS_WAIT_DEADLOCK
+int OS_WaitTimeout(Sema4Type *semaPt, uint32_t timeout) {
     int32_t sr;
     OSCRITICAL_ENTER();
+    if (semaPt->Value > 0) {
+        semaPt->Value -= 1;
+        OSCRITICAL_EXIT();
+        return OS_WAIT_OK;
+    }
+    if (timeout == 0) {
+        OSCRITICAL_EXIT();
+        return OS_WAIT_TIMEOUT;
+    }
+    semaPt->Value -= 1;
+    RunPt->waitResult = OS_WAIT_OK;
+    if (timeout != OS_FOREVER) {
+        timeout_list_insert(RunPt, timeout);
+    }
+#if (DEADLOCK_DETECTION)
+    RunPt->abortable = 1;
+#endif
+    sema_block(semaPt);
+    OSCRITICAL_EXIT();
+    OS_Suspend();  // Woken by a signal, the timeout or deadlock recovery
+    OSCRITICAL_ENTER();
+#if (DEADLOCK_DETECTION)
+    RunPt->abortable = 0;
+#endif
+    int32_t result = RunPt->waitResult;
+    OSCRITICAL_EXIT();
+    return result;
+}
+
+// Increments the semaphore and wakes the first highest priority waiter
+// Returns the thread woken, NULL if none. Interrupts must be disabled.
+TCB *sema_signal(Sema4Type *semaPt) {
     semaPt->Value += 1;
     if (semaPt->Value <= 0) {
         uint32_t priority;
@@ -318,22 +836,91 @@ void OS_Signal(Sema4Type *semaPt) {
                 // Update thread
                 thread->status = ACTIVE;
                 thread->SemaPt = NULL;
+                if (thread->timed) {
+                    timeout_list_remove(thread);
+                }
 
                 // Add blocked thread back to priority list
-                PriorityPts[priority] = tcb_list_add(PriorityPts[priority], thread);
+                ready_list_add(thread);
 
-                break;
+                return thread;
             }
         }
     }
+    return NULL;
+}
+
+#if (DEADLOCK_DETECTION)
+// Records the caller as able to signal semaPt again, interrupt handlers
+// always can, so waits on semaphores they signal never deadlock
+void sema_add_producer(Sema4Type *semaPt) {
+#if (OS_HOSTED)
+    if (Host_InHandler()) {
+#else
+    if (NVIC_INT_CTRL_R & NVIC_INT_CTRL_VEC_ACT_M) {
+#endif
+        semaPt->background = 1;
+    } else {
+        semaPt->producers[RunPt->id / 32] |= 1u << (RunPt->id % 32);
+    }
+}
+
+// Gives a binary semaphore to thread, interrupts must be disabled
+void sema_hold(Sema4Type *semaPt, TCB *thread) {
+    semaPt->holder = thread;
+    semaPt->next = thread->held;
+    thread->held = semaPt;
+}
+#endif
+
+// Releases a binary semaphore, a waiter gets it handed over so it never looks free
+// while it is still owned. Interrupts must be disabled.
+void sema_release(Sema4Type *semaPt) {
+#if (DEADLOCK_DETECTION)
+    if (semaPt->holder != NULL) {
+        Sema4Type **link = &semaPt->holder->held;
+        while (*link != NULL && *link != semaPt) {
+            link = &(*link)->next;
+        }
+        if (*link != NULL) {
+            *link = semaPt->next;
+        }
+        semaPt->holder = NULL;
+    }
+    semaPt->next = NULL;
+    TCB *next = sema_signal(semaPt);
+    if (next != NULL) {
+        sema_hold(semaPt, next);
+    }
+#else
+    sema_signal(semaPt);
+#endif
+}
+
+// ******** OS_Signal ************
+// increment semaphore
+// Lab2 spinlock
+// Lab3 wakeup blocked thread if appropriate
+// input:  pointer to a counting semaphore
+// output: none
+void OS_Signal(Sema4Type *semaPt) {
+    int32_t sr;
+    OSCRITICAL_ENTER();
+#if (DEADLOCK_DETECTION)
+    sema_add_producer(semaPt);
+#endif
+    sema_signal(semaPt);
     OSCRITICAL_EXIT();
 };
 
 void OS_SignalAll(Sema4Type *semaPt) {
     int32_t sr;
     OSCRITICAL_ENTER();
+#if (DEADLOCK_DETECTION)
+    sema_add_producer(semaPt);
+#endif
     while (semaPt->Value < 0) {
-        OS_Signal(semaPt);
+        sema_signal(semaPt);
     }
     OSCRITICAL_EXIT();
 }
@@ -345,6 +932,14 @@ void OS_SignalAll(Sema4Type *semaPt) {
 // output: none
 void OS_bWait(Sema4Type *semaPt) {
     OS_Wait(semaPt);
+#if (DEADLOCK_DETECTION)
+    int32_t sr;
+    OSCRITICAL_ENTER();
+    if (semaPt->holder != RunPt) {
+        sema_hold(semaPt, RunPt);  // not handed over by OS_bSignal, it was free
+    }
+    OSCRITICAL_EXIT();
+#endif
 };
 
 // ******** OS_bSignal ************
@@ -353,12 +948,29 @@ void OS_bWait(Sema4Type *semaPt) {
 // input:  pointer to a binary semaphore
 // output: none
 void OS_bSignal(Sema4Type *semaPt) {
-    OS_Signal(semaPt);
+    int32_t sr;
+    OSCRITICAL_ENTER();
+    sema_release(semaPt);
+    OSCRITICAL_EXIT();
 };
 
+void OS_SemaphoreProducer(Sema4Type *semaPt, uint32_t tid, int producer) {
+#if (DEADLOCK_DETECTION)
+    int32_t sr;
+    OSCRITICAL_ENTER();
+    if (producer) {
+        semaPt->producers[tid / 32] |= 1u << (tid % 32);
+    } else {
+        semaPt->producers[tid / 32] &= ~(1u << (tid % 32));
+    }
+    OSCRITICAL_EXIT();
+#endif
+}
+
 #if (DEADLOCK_DETECTION)
 // Adds an element to the list and returns the head
 Lock *lock_list_append(Lock *head, Lock *elem) {
+    elem->next = NULL;
     if (head == NULL) {
         return elem;
     }
@@ -368,7 +980,6 @@ Lock *lock_list_append(Lock *head, Lock *elem) {
         curr = curr->next;
     }
     curr->next = elem;
-    elem->next = NULL;
 
     return head;
 }
@@ -384,7 +995,9 @@ Lock *lock_list_remove(Lock *head, Lock *elem) {
     }
 
     if (head == elem) {
-        return head->next;
+        head = head->next;
+        elem->next = NULL;
+        return head;
     }
 
     Lock *curr = head;
@@ -401,190 +1014,500 @@ Lock *lock_list_remove(Lock *head, Lock *elem) {
 
     return head;
 }
-#endif
+#endif
+
+// Initializes a Lock instance
+void OS_InitLock(Lock *lock) {
+    OS_InitSemaphore(&(lock->sema), 1);
+    lock->holder = NULL;
+#if (DEADLOCK_DETECTION)
+    lock->next = NULL;
+#endif
+}
+
+// Gives lock to thread, interrupts must be disabled
+void lock_hold(Lock *lock, TCB *thread) {
+    lock->holder = thread;
+#if (DEADLOCK_DETECTION)
+    thread->LockPt = NULL;
+    thread->lockStart = 0;
+    thread->acquired = lock_list_append(thread->acquired, lock);
+#endif
+}
+
+// Releases lock for its holder, a waiter gets it handed over so it never
+// looks free while it is still owned. Interrupts must be disabled.
+void lock_release(Lock *lock) {
+    TCB *holder = lock->holder;
+#if (DEADLOCK_DETECTION)
+    holder->acquired = lock_list_remove(holder->acquired, lock);
+#endif
+    lock->holder = NULL;
+    TCB *next = sema_signal(&(lock->sema));
+    if (next != NULL) {
+        lock_hold(lock, next);
+    }
+#if (LOCK_PRIORITY_INHERITANCE)
+    // The old holder drops what it inherited through this lock,
+    // the new one takes over the remaining waiters
+    priority_inherit(holder);
+    priority_inherit(next);
+#endif
+}
+
+// Acquires the lock
+void OS_LockAcquire(Lock *lock) {
+    int32_t sr;
+#if (DEADLOCK_DETECTION)
+    RunPt->LockPt = lock;  // checked for cycles in OS_Wait if it blocks
+#endif
+    OS_Wait(&(lock->sema));
+    OSCRITICAL_ENTER();
+    if (lock->holder != RunPt) {
+        lock_hold(lock, RunPt);  // not handed over by OS_LockRelease, it was free
+    }
+    OSCRITICAL_EXIT();
+}
+
+int OS_LockAcquireTimeout(Lock *lock, uint32_t timeout) {
+    int32_t sr;
+#if (DEADLOCK_DETECTION)
+    RunPt->LockPt = lock;
+#endif
+    int result = OS_WaitTimeout(&(lock->sema), timeout);
+    OSCRITICAL_ENTER();
+    if (result == OS_WAIT_OK && lock->holder != RunPt) {
+        lock_hold(lock, RunPt);
+    }
+#if (DEADLOCK_DETECTION)
+    RunPt->LockPt = NULL;
+#endif
+    OSCRITICAL_EXIT();
+#if (DEADLOCK_DETECTION)
+    if (result == OS_WAIT_DEADLOCK) {
+        // Give the rest of the cycle what it was waiting for
+        if (RunPt->cleanup != NULL) {
+            RunPt->cleanup();
+        }
+        while (RunPt->acquired != NULL) {
+            OS_LockRelease(RunPt->acquired);
+        }
+    }
+#endif
+    return result;
+}
+
+int OS_LockAcquireAbortable(Lock *lock) {
+    return OS_LockAcquireTimeout(lock, OS_FOREVER);
+}
+
+void OS_LockCleanup(void (*cleanup)(void)) {
+#if (DEADLOCK_DETECTION)
+    RunPt->cleanup = cleanup;
+#endif
+}
+
+// Releases the lock
+int OS_LockRelease(Lock *lock) {
+    if (lock->holder != RunPt) {
+        return 1;
+    }
+
+    int32_t sr;
+    OSCRITICAL_ENTER();
+#if (LOCK_PRIORITY_INHERITANCE)
+    uint32_t priority = RunPt->priority;
+#endif
+    lock_release(lock);
+    OSCRITICAL_EXIT();
+#if (LOCK_PRIORITY_INHERITANCE)
+    if (RunPt->priority > priority) {
+        OS_Suspend();  // lost an inherited priority, let the waiter it was boosted for run
+    }
+#endif
+    return 0;
+}
+
+// Object pools
+// Free blocks are handed out oldest first, so a TCB given back by OS_Kill
+// while its thread still runs on its stack is the last one reused.
+
+// Takes the oldest free block, there must be one. Interrupts must be disabled.
+void *pool_take(PoolType *pool) {
+    void *block = pool->head;
+    pool->head = *(void **)block;
+    if (pool->head == NULL) {
+        pool->tail = NULL;
+    }
+    return block;
+}
+
+// Takes a free block nobody has been promised, NULL if none.
+// Interrupts must be disabled.
+void *pool_try(PoolType *pool) {
+    if (pool->free.Value <= 0) {
+        return NULL;
+    }
+    pool->free.Value -= 1;
+    return pool_take(pool);
+}
+
+// Gives a block back, waking a waiter. Interrupts must be disabled.
+void pool_release(PoolType *pool, void *block) {
+    *(void **)block = NULL;
+    if (pool->tail == NULL) {
+        pool->head = block;
+    } else {
+        *(void **)pool->tail = block;
+    }
+    pool->tail = block;
+    sema_signal(&pool->free);
+}
+
+int OS_PoolInit(PoolType *pool, void *blocks, uint32_t size, uint32_t count) {
+    if (blocks == NULL || size < sizeof(void *) || size % sizeof(void *) != 0 ||
+        (uintptr_t)blocks % sizeof(void *) != 0) {
+        return 0;
+    }
+    pool->blocks = blocks;
+    pool->size = size;
+    pool->count = count;
+    pool->head = pool->tail = NULL;
+    OS_InitSemaphore(&pool->free, 0);
+#if (DEADLOCK_DETECTION)
+    pool->free.background = 1;  // any thread or handler may free a block, waits are never deadlocked
+#endif
+    for (uint32_t i = 0; i < count; i++) {
+        pool_release(pool, pool->blocks + i * size);
+    }
+    return 1;
+}
+
+void *OS_PoolAlloc(PoolType *pool, uint32_t timeout) {
+    int32_t sr;
+    OSCRITICAL_ENTER();
+    void *block = pool_try(pool);
+    OSCRITICAL_EXIT();
+    if (block == NULL && timeout != 0 && OS_WaitTimeout(&pool->free, timeout) == OS_WAIT_OK) {
+        OSCRITICAL_ENTER();
+        block = pool_take(pool);  // promised to us by pool_release
+        OSCRITICAL_EXIT();
+    }
+    return block;
+}
+
+int OS_PoolFree(PoolType *pool, void *block) {
+    int32_t sr;
+    uint32_t offset = (uint8_t *)block - pool->blocks;
+    if ((uint8_t *)block < pool->blocks || offset >= pool->size * pool->count || offset % pool->size != 0) {
+        return 0;
+    }
+    OSCRITICAL_ENTER();
+    pool_release(pool, block);
+    OSCRITICAL_EXIT();
+    return 1;
+}
 
-// Initializes a Lock instance
-void OS_InitLock(Lock *lock) {
-    OS_InitSemaphore(&(lock->sema), 1);
-    lock->holder = NULL;
-#if (DEADLOCK_DETECTION)
-    lock->next = NULL;
+// Returns the lowest word of the stack thread runs on that it may use
+uint32_t *stack_bottom(TCB *thread) {
+#if (OS_HOSTED)
+    return Host_StackBottom(thread);
+#elif (STACK_MPU)
+    return (uint32_t *)(((uint32_t)((uint32_t *)thread + TCB_WORDS) + 31) & ~31) + 8;  // above the guard
+#else
+    return (uint32_t *)thread + TCB_WORDS;
 #endif
 }
 
-// Acquires the lock
-void OS_LockAcquire(Lock *lock) {
-#if (DEADLOCK_DETECTION)
-    RunPt->lockStart = OS_MsTime();
-    RunPt->LockPt = lock;
+// Returns the word past the top of the stack thread runs on
+uint32_t *stack_top(TCB *thread) {
+#if (OS_HOSTED)
+    return Host_StackBottom(thread) + HOST_STACK_BYTES / 4;
+#else
+    return (uint32_t *)thread + TCB_WORDS + thread->stackWords;
 #endif
-    OS_Wait(&(lock->sema));
-    lock->holder = RunPt;
+}
 
+// Gives the id and chunk of a killed thread back. Interrupts must be disabled.
+void thread_release(TCB *thread) {
+    uint32_t cls = thread->stackWords / STACK_MIN_WORDS - 1;
+    tcb_table[thread->id] = NULL;
 #if (DEADLOCK_DETECTION)
-    RunPt->LockPt = NULL;
-    RunPt->lockStart = 0;
-    RunPt->acquired = lock_list_append(RunPt->acquired, lock);
+    thread->visited = 0;  // DeadlockMark no longer sees it
 #endif
+    free_ids[num_free_ids++] = thread->id;
+    thread->next = stack_free[cls];
+    stack_free[cls] = thread;
 }
 
-// Releases the lock
-int OS_LockRelease(Lock *lock) {
-    if (lock->holder != RunPt) {
-        return 1;
+// Gives the chunk of the thread that killed itself back once it no longer
+// runs. Interrupts must be disabled.
+void thread_reap(void) {
+    if (Zombie != NULL && Zombie != RunPt) {
+        thread_release(Zombie);
+        Zombie = NULL;
     }
-
-    lock->holder = NULL;
-
-#if (DEADLOCK_DETECTION)
-    RunPt->acquired = lock_list_remove(RunPt->acquired, lock);
-#endif
-    OS_Signal(&(lock->sema));
-    return 0;
 }
 
-//******** OS_AddThread ***************
-// add a foregound thread to the scheduler
-// Inputs: pointer to a void/void foreground task
-//         number of bytes allocated for its stack
-//         priority, 0 is highest, 5 is the lowest
-// Outputs: 1 if successful, 0 if this thread can not be added
-// stack size must be divisable by 8 (aligned to double word boundary)
-// In Lab 2, you can ignore both the stackSize and priority fields
-// In Lab 3, you can ignore the stackSize fields
-int OS_AddThread(void (*task)(void),
-                 uint32_t stackSize, uint32_t priority) {
-    int32_t sr;
-    OSCRITICAL_ENTER();
-    uint32_t tid;
+// Gives the id and chunk of a killed thread back, after the switch away from
+// it if it is running. Interrupts must be disabled.
+void thread_retire(TCB *thread) {
+    thread_reap();
+    if (thread == RunPt) {
+        Zombie = thread;
+    } else {
+        thread_release(thread);
+    }
+}
 
-    // Search for an available TCB
-    for (tid = 0; tid < MAX_THREADS; tid++) {
-        if (tcb_pool[tid].status == DEAD) {
-            break;
+// Takes a free id and a chunk with a stack of at least stackSize bytes, NULL
+// if there is none. Once the arena is used up a bigger stack is given if no
+// killed thread left one of the size asked for. Interrupts must be disabled.
+TCB *thread_alloc(uint32_t stackSize) {
+    stackSize += 4 * STACK_GUARD_WORDS;
+    uint32_t words = (stackSize + 4 * STACK_MIN_WORDS - 1) / (4 * STACK_MIN_WORDS) * STACK_MIN_WORDS;
+    words = (words < STACK_MIN_WORDS) ? STACK_MIN_WORDS : words;
+    if (words > STACK_MAX_WORDS) {
+        return NULL;
+    }
+    thread_reap();
+    if (num_free_ids == 0) {
+        return NULL;
+    }
+    TCB *thread;
+    uint32_t cls = words / STACK_MIN_WORDS - 1;
+    if (stack_free[cls] == NULL && stack_arena_used + TCB_WORDS + words <= STACK_ARENA_WORDS) {
+        thread = (TCB *)((uint32_t *)stack_arena + stack_arena_used);
+        stack_arena_used += TCB_WORDS + words;
+        thread->stackWords = words;
+#if (OS_HOSTED)
+        thread->context = NULL;
+#endif
+    } else {
+        while (cls < STACK_CLASSES && stack_free[cls] == NULL) {
+            cls++;
+        }
+        if (cls == STACK_CLASSES) {
+            return NULL;
         }
+        thread = stack_free[cls];
+        stack_free[cls] = thread->next;
     }
+    thread->id = free_ids[--num_free_ids];
+    tcb_table[thread->id] = thread;
+    return thread;
+}
 
-    if (tid == MAX_THREADS) {
-        goto OS_AddThread_exit;
+// Adds a thread of process in its own TCB and stack, returns 0 if there is
+// no free id or no room for the stack. Interrupts must be disabled.
+int thread_add(void (*task)(void), uint32_t stackSize, uint32_t priority, PCB *process) {
+    TCB *thread = thread_alloc(stackSize);
+    if (thread == NULL) {
+        return 0;
     }
 
     // Clamp priority to maximum value
     priority = (priority < PRIORITY_LEVELS) ? priority : PRIORITY_LEVELS - 1;
 
     // Initialize TCB and stack for new thread
-    tcb_pool[tid].id = tid;
-    tcb_pool[tid].priority = priority;
-    tcb_pool[tid].sleepCount = 0;
-    tcb_pool[tid].status = ACTIVE;
-    tcb_pool[tid].sp = &stack_pool[tid][STACK_SIZE - 16];
-    if (RunPt != NULL) {
-        tcb_pool[tid].process = RunPt->process;
-        tcb_pool[tid].process->num_threads++;
-    }
+    thread->priority = priority;
+#if (LOCK_PRIORITY_INHERITANCE)
+    thread->basePriority = priority;
+#endif
+    thread->sleepCount = 0;
+    thread->timed = 0;
+    thread->status = ACTIVE;
+    thread->process = process;
 #if (DEADLOCK_DETECTION)
-    tcb_pool[tid].lockStart = 0;
-    tcb_pool[tid].LockPt = NULL;
-    tcb_pool[tid].acquired = NULL;
-    tcb_pool[tid].visited = 0;
-#endif
-    stack_pool[tid][STACK_SIZE - 1] = 0x01000000;                                                                               // PSR (thumb bit = 1)
-    stack_pool[tid][STACK_SIZE - 2] = (uint32_t)task;                                                                           // PC
-    stack_pool[tid][STACK_SIZE - 3] = (uint32_t)&OS_Kill;                                                                       // R14
-    stack_pool[tid][STACK_SIZE - 4] = 0x12121212;                                                                               // R12
-    stack_pool[tid][STACK_SIZE - 5] = 0x03030303;                                                                               // R3
-    stack_pool[tid][STACK_SIZE - 6] = 0x02020202;                                                                               // R2
-    stack_pool[tid][STACK_SIZE - 7] = 0x01010101;                                                                               // R1
-    stack_pool[tid][STACK_SIZE - 8] = 0x00000000;                                                                               // R0
-    stack_pool[tid][STACK_SIZE - 9] = 0x11111111;                                                                               // R11
-    stack_pool[tid][STACK_SIZE - 10] = 0x10101010;                                                                              // R10
-    stack_pool[tid][STACK_SIZE - 11] = (tcb_pool[tid].process != NULL) ? (uint32_t)(tcb_pool[tid].process->data) : 0x09090909;  // R9
-    stack_pool[tid][STACK_SIZE - 12] = 0x08080808;                                                                              // R8
-    stack_pool[tid][STACK_SIZE - 13] = 0x07070707;                                                                              // R7
-    stack_pool[tid][STACK_SIZE - 14] = 0x06060606;                                                                              // R6
-    stack_pool[tid][STACK_SIZE - 15] = 0x05050505;                                                                              // R5
-    stack_pool[tid][STACK_SIZE - 16] = 0x04040404;                                                                              // R4
+    thread->lockStart = 0;
+    thread->LockPt = NULL;
+    thread->acquired = NULL;
+    thread->held = NULL;
+    thread->visited = 0;
+    thread->abortable = 0;
+    thread->cleanup = NULL;
+#endif
+#if (OS_HOSTED)
+    Host_InitContext(thread, task);  // paints the host stack
+#else
+    uint32_t *stack = stack_top(thread);  // full descending
+    thread->sp = &stack[-17];
+#if (STACK_CHECK)
+    for (uint32_t *word = stack_bottom(thread); word < thread->sp; word++) {
+        *word = STACK_CANARY;
+    }
+#endif
+    stack[-1] = 0x01000000;                                                       // PSR (thumb bit = 1)
+    stack[-2] = (uint32_t)task;                                                   // PC
+    stack[-3] = (uint32_t)&OS_Kill;                                               // R14
+    stack[-4] = 0x12121212;                                                       // R12
+    stack[-5] = 0x03030303;                                                       // R3
+    stack[-6] = 0x02020202;                                                       // R2
+    stack[-7] = 0x01010101;                                                       // R1
+    stack[-8] = 0x00000000;                                                       // R0
+    stack[-9] = 0xFFFFFFF9;                                                       // EXC_RETURN (thread mode, MSP, no FPU)
+    stack[-10] = 0x11111111;                                                      // R11
+    stack[-11] = 0x10101010;                                                      // R10
+    stack[-12] = (process != NULL) ? (uint32_t)(process->data) : 0x09090909;      // R9
+    stack[-13] = 0x08080808;                                                      // R8
+    stack[-14] = 0x07070707;                                                      // R7
+    stack[-15] = 0x06060606;                                                      // R6
+    stack[-16] = 0x05050505;                                                      // R5
+    stack[-17] = 0x04040404;                                                      // R4
+#endif
 
     // Add new thread to end of priority linked list
-    PriorityPts[priority] = tcb_list_add(PriorityPts[priority], &tcb_pool[tid]);
+    ready_list_add(thread);
     if (RunPt == NULL) {
-        RunPt = &tcb_pool[tid];
+        RunPt = thread;
     }
 
     if (NextPt == NULL) {
         NextPt = RunPt;
     }
     num_created++;
+    return 1;
+}
 
-OS_AddThread_exit:
-    OSCRITICAL_EXIT();
-    return (tid == MAX_THREADS) ? 0 : 1;
-};
+// Message queues
+// Senders wait on slots and receivers on items, each promised element is
+// copied under the same critical section that moves the index, so senders
+// and receivers never see a slot half written.
+
+// Copies msg to the back of the queue, which has a slot promised to the
+// caller, and wakes a receiver. Interrupts must be disabled.
+void queue_put(QueueType *queue, const void *msg) {
+    memcpy(queue->buffer + queue->put * queue->size, msg, queue->size);
+    queue->put = (queue->put + 1 == queue->depth) ? 0 : queue->put + 1;
+    queue->count++;
+#if (DEADLOCK_DETECTION)
+    sema_add_producer(&queue->items);
+#endif
+    sema_signal(&queue->items);
+}
 
-int OS_ProcessAddInitialThread(void (*task)(void),
-                               uint32_t stackSize, uint32_t priority, PCB *process) {
+// Copies the oldest element, promised to the caller, to msg and wakes a
+// sender. Interrupts must be disabled.
+void queue_get(QueueType *queue, void *msg) {
+    memcpy(msg, queue->buffer + queue->get * queue->size, queue->size);
+    queue->get = (queue->get + 1 == queue->depth) ? 0 : queue->get + 1;
+    queue->count--;
+#if (DEADLOCK_DETECTION)
+    sema_add_producer(&queue->slots);
+#endif
+    sema_signal(&queue->slots);
+}
+
+int OS_QueueInit(QueueType *queue, const char *name, void *buffer, uint32_t size, uint32_t depth) {
     int32_t sr;
+    if (buffer == NULL || size == 0 || depth == 0) {
+        return 0;
+    }
+    queue->name = name;
+    queue->buffer = buffer;
+    queue->size = size;
+    queue->depth = depth;
+    queue->put = queue->get = queue->count = 0;
+    OS_InitSemaphore(&queue->items, 0);
+    OS_InitSemaphore(&queue->slots, depth);
     OSCRITICAL_ENTER();
-    uint32_t tid;
-
-    // Search for an available TCB
-    for (tid = 0; tid < MAX_THREADS; tid++) {
-        if (tcb_pool[tid].status == DEAD) {
-            break;
-        }
+    QueueType *other = Queues;
+    while (other != NULL && other != queue) {
+        other = other->next;
     }
-
-    if (tid == MAX_THREADS) {
-        goto OS_AddThread_exit;
+    if (other == NULL) {  // not already there from an earlier OS_QueueInit
+        queue->next = Queues;
+        Queues = queue;
     }
+    OSCRITICAL_EXIT();
+    return 1;
+}
 
-    // Clamp priority to maximum value
-    priority = (priority < PRIORITY_LEVELS) ? priority : PRIORITY_LEVELS - 1;
+QueueType *OS_QueueFind(const char *name) {
+    int32_t sr;
+    OSCRITICAL_ENTER();
+    QueueType *queue = Queues;
+    while (queue != NULL && strcmp(queue->name, name) != 0) {
+        queue = queue->next;
+    }
+    OSCRITICAL_EXIT();
+    return queue;
+}
 
-    // Initialize TCB and stack for new thread
-    tcb_pool[tid].id = tid;
-    tcb_pool[tid].priority = priority;
-    tcb_pool[tid].sleepCount = 0;
-    tcb_pool[tid].status = ACTIVE;
-    tcb_pool[tid].sp = &stack_pool[tid][STACK_SIZE - 16];
-    tcb_pool[tid].process = process;
-#if (DEADLOCK_DETECTION)
-    tcb_pool[tid].lockStart = 0;
-    tcb_pool[tid].LockPt = NULL;
-    tcb_pool[tid].acquired = NULL;
-    tcb_pool[tid].visited = 0;
-#endif
-    stack_pool[tid][STACK_SIZE - 1] = 0x01000000;                                                   // PSR (thumb bit = 1)
-    stack_pool[tid][STACK_SIZE - 2] = (uint32_t)task;                                               // PC
-    stack_pool[tid][STACK_SIZE - 3] = (uint32_t)&OS_Kill;                                           // R14
-    stack_pool[tid][STACK_SIZE - 4] = 0x12121212;                                                   // R12
-    stack_pool[tid][STACK_SIZE - 5] = 0x03030303;                                                   // R3
-    stack_pool[tid][STACK_SIZE - 6] = 0x02020202;                                                   // R2
-    stack_pool[tid][STACK_SIZE - 7] = 0x01010101;                                                   // R1
-    stack_pool[tid][STACK_SIZE - 8] = 0x00000000;                                                   // R0
-    stack_pool[tid][STACK_SIZE - 9] = 0x11111111;                                                   // R11
-    stack_pool[tid][STACK_SIZE - 10] = 0x10101010;                                                  // R10
-    stack_pool[tid][STACK_SIZE - 11] = (process != NULL) ? (uint32_t)(process->data) : 0x09090909;  // R9
-    stack_pool[tid][STACK_SIZE - 12] = 0x08080808;                                                  // R8
-    stack_pool[tid][STACK_SIZE - 13] = 0x07070707;                                                  // R7
-    stack_pool[tid][STACK_SIZE - 14] = 0x06060606;                                                  // R6
-    stack_pool[tid][STACK_SIZE - 15] = 0x05050505;                                                  // R5
-    stack_pool[tid][STACK_SIZE - 16] = 0x04040404;                                                  // R4
+int OS_QueueSend(QueueType *queue, const void *msg, uint32_t timeout) {
+    int32_t sr;
+    OSCRITICAL_ENTER();
+    if (queue->slots.Value > 0) {
+        queue->slots.Value -= 1;
+        queue_put(queue, msg);
+        OSCRITICAL_EXIT();
+        return OS_WAIT_OK;
+    }
+    OSCRITICAL_EXIT();
+    int result = OS_WaitTimeout(&queue->slots, timeout);
+    if (result == OS_WAIT_OK) {
+        OSCRITICAL_ENTER();
+        queue_put(queue, msg);  // slot promised to us by queue_get
+        OSCRITICAL_EXIT();
+    }
+    return result;
+}
 
-    // Add new thread to end of priority linked list
-    PriorityPts[priority] = tcb_list_add(PriorityPts[priority], &tcb_pool[tid]);
-    if (RunPt == NULL) {
-        RunPt = &tcb_pool[tid];
+int OS_QueueReceive(QueueType *queue, void *msg, uint32_t timeout) {
+    int32_t sr;
+    OSCRITICAL_ENTER();
+    if (queue->items.Value > 0) {
+        queue->items.Value -= 1;
+        queue_get(queue, msg);
+        OSCRITICAL_EXIT();
+        return OS_WAIT_OK;
+    }
+    OSCRITICAL_EXIT();
+    int result = OS_WaitTimeout(&queue->items, timeout);
+    if (result == OS_WAIT_OK) {
+        OSCRITICAL_ENTER();
+        queue_get(queue, msg);  // element promised to us by queue_put
+        OSCRITICAL_EXIT();
     }
+    return result;
+}
 
-    if (NextPt == NULL) {
-        NextPt = RunPt;
+uint32_t OS_QueueCount(QueueType *queue) {
+    int32_t sr;
+    OSCRITICAL_ENTER();
+    uint32_t count = queue->count;
+    OSCRITICAL_EXIT();
+    return count;
+}
+
+//******** OS_AddThread ***************
+// add a foregound thread to the scheduler
+// Inputs: pointer to a void/void foreground task
+//         number of bytes allocated for its stack
+//         priority, 0 is highest, 5 is the lowest
+// Outputs: 1 if successful, 0 if this thread can not be added
+// The stack is rounded up to a multiple of STACK_MIN_WORDS words, at most
+// STACK_MAX_WORDS, and taken from the stack arena with the TCB
+int OS_AddThread(void (*task)(void),
+                 uint32_t stackSize, uint32_t priority) {
+    int32_t sr;
+    OSCRITICAL_ENTER();
+    PCB *process = (RunPt != NULL) ? RunPt->process : NULL;
+    int added = thread_add(task, stackSize, priority, process);
+    if (added && process != NULL) {
+        process->num_threads++;
     }
-    num_created++;
+    OSCRITICAL_EXIT();
+    return added;
+};
 
-OS_AddThread_exit:
+int OS_ProcessAddInitialThread(void (*task)(void),
+                               uint32_t stackSize, uint32_t priority, PCB *process) {
+    int32_t sr;
+    OSCRITICAL_ENTER();
+    int added = thread_add(task, stackSize, priority, process);
     OSCRITICAL_EXIT();
-    return (tid == MAX_THREADS) ? 0 : 1;
+    return added;
 };
 
 //******** OS_AddProcess ***************
@@ -609,16 +1532,13 @@ int OS_AddProcess(void (*entry)(void), void *text, void *data,
     OSCRITICAL_ENTER();
     uint32_t pid;
 
-    // Search for an available PCB
-    for (pid = 0; pid < MAX_PROCESSES; pid++) {
-        if (pcb_pool[pid].status == DEAD) {
-            break;
-        }
-    }
-
-    if (pid == MAX_PROCESSES) {
+    // Take an available PCB
+    PCB *process = pool_try(&PcbPool);
+    if (process == NULL) {
+        pid = MAX_PROCESSES;
         goto OS_AddProcess_Exit;
     }
+    pid = process - pcb_pool;
 
     pcb_pool[pid].id = pid;
     pcb_pool[pid].num_threads = 1;
@@ -626,7 +1546,11 @@ int OS_AddProcess(void (*entry)(void), void *text, void *data,
     pcb_pool[pid].data = data;
     pcb_pool[pid].status = ACTIVE;
 
-    OS_ProcessAddInitialThread(entry, stackSize, priority, &pcb_pool[pid]);
+    if (!OS_ProcessAddInitialThread(entry, stackSize, priority, &pcb_pool[pid])) {
+        pcb_pool[pid].status = DEAD;
+        pool_release(&PcbPool, &pcb_pool[pid]);
+        pid = MAX_PROCESSES;
+    }
 
 OS_AddProcess_Exit:
     OSCRITICAL_EXIT();
@@ -641,6 +1565,21 @@ uint32_t OS_Id(void) {
     return RunPt->id;
 };
 
+int32_t OS_TryId(void) {
+#if (OS_HOSTED)
+    if (RunPt == NULL || Host_InHandler()) {
+#else
+    if (RunPt == NULL || (NVIC_INT_CTRL_R & NVIC_INT_CTRL_VEC_ACT_M)) {
+#endif
+        return -1;
+    }
+    return RunPt->id;
+}
+
+uint32_t OS_Priority(void) {
+    return RunPt->priority;
+}
+
 #if (MEASURE_PERIODIC_JITTER)
 void (*periodicTask1)(void);
 void (*periodicTask2)(void);
@@ -751,6 +1690,7 @@ int OS_AddPeriodicThread(void (*task)(void),
 void (*SW1Task)(void);
 void (*SW2Task)(void);
 
+#if (!OS_HOSTED)
 void GPIOPortF_Handler(void) {
     if (GPIO_PORTF_RIS_R & 0x10) {  // if trigger flag set SW1/PF4
         SW1Task();
@@ -801,6 +1741,11 @@ void SW2_Init(uint32_t priority) {
     NVIC_PRI7_R = (NVIC_PRI7_R & 0xFF00FFFF) | (priority << 21);  // set priority
     NVIC_EN0_R = 0x40000000;                                      // enable interrupt 30 in NVIC
 }
+#else
+// No switches on the host, the tasks are recorded but never triggered
+void SW1_Init(uint32_t priority) {}
+void SW2_Init(uint32_t priority) {}
+#endif
 
 //******** OS_AddSW1Task ***************
 // add a background task to run whenever the SW1 (PF4) button is pushed
@@ -848,8 +1793,17 @@ int OS_AddSW2Task(void (*task)(void), uint32_t priority) {
 // OS_Sleep(0) implements cooperative multitasking
 void OS_Sleep(uint32_t sleepTime) {
     if (sleepTime > 0) {
+#if (READY_BITMAP)
+        int32_t sr;
+        OSCRITICAL_ENTER();
+        RunPt->status = SLEEPING;  // change status to sleep
+        ready_list_remove(RunPt);
+        sleep_list_insert(RunPt, sleepTime);
+        OSCRITICAL_EXIT();
+#else
         RunPt->status = SLEEPING;  // change status to sleep
         RunPt->sleepCount = sleepTime;
+#endif
     }
     OS_Suspend();
 };
@@ -862,26 +1816,27 @@ void OS_Kill(void) {
     int32_t sr;
     OSCRITICAL_ENTER();
 #if (DEADLOCK_DETECTION)
-    // Release all held locks
-    Lock *curr = RunPt->acquired;
-    while (curr != NULL) {
-        OS_LockRelease(curr);
-        curr = curr->next;
+    // Release all held locks and binary semaphores
+    while (RunPt->acquired != NULL) {
+        lock_release(RunPt->acquired);
+    }
+    while (RunPt->held != NULL) {
+        sema_release(RunPt->held);
     }
 #endif
     RunPt->status = DEAD;
+    Heap_ReleaseCache(RunPt->id);
     if (RunPt->process != NULL) {
         RunPt->process->num_threads--;
         if (RunPt->process->num_threads == 0) {
             Heap_Free(RunPt->process->text);
             Heap_Free(RunPt->process->data);
             RunPt->process->status = DEAD;
+            pool_release(&PcbPool, RunPt->process);
         }
     }
-    PriorityPts[RunPt->priority] = tcb_list_remove(RunPt);
-    if (PriorityPts[RunPt->priority] != NULL) {
-        PriorityPts[RunPt->priority] = PriorityPts[RunPt->priority]->prev;
-    }
+    ready_list_remove(RunPt);
+    thread_retire(RunPt);
     num_killed++;
     OSCRITICAL_EXIT();
     OS_Suspend();
@@ -894,37 +1849,114 @@ void OS_Kill(void) {
 void OS_Kill_Thread(uint32_t tid) {
     int32_t sr;
     OSCRITICAL_ENTER();
-    TCB *thread = &tcb_pool[tid];
+    TCB *thread = (tid < MAX_THREADS) ? tcb_table[tid] : NULL;
+    if (thread == NULL || thread->status == DEAD) {
+        OSCRITICAL_EXIT();
+        return;
+    }
 #if (DEADLOCK_DETECTION)
-    // Release all held locks
-    Lock *curr = thread->acquired;
-    while (curr != NULL) {
-        OS_LockRelease(curr);
-        curr = curr->next;
+    // Release all held locks and binary semaphores
+    while (thread->acquired != NULL) {
+        lock_release(thread->acquired);
+    }
+    while (thread->held != NULL) {
+        sema_release(thread->held);
     }
 #endif
-    thread->status = DEAD;
+    Heap_ReleaseCache(tid);
     if (thread->process != NULL) {
         thread->process->num_threads--;
         if (thread->process->num_threads == 0) {
             Heap_Free(thread->process->text);
             Heap_Free(thread->process->data);
             thread->process->status = DEAD;
+            pool_release(&PcbPool, thread->process);
         }
     }
-    if (thread == PriorityPts[thread->priority]) {
-        PriorityPts[thread->priority] = tcb_list_remove(thread);
-        if (PriorityPts[thread->priority] != NULL) {
-            PriorityPts[thread->priority] = PriorityPts[thread->priority]->prev;
-        }
-    } else if (thread->SemaPt != NULL && thread == thread->SemaPt->BlockedPts[thread->priority]) {
-        thread->SemaPt->BlockedPts[thread->priority] = tcb_list_remove(thread);
+    if (thread->status == BLOCKED) {
+        sema_queue_remove(thread);
+#if (READY_BITMAP)
+    } else if (thread->status == SLEEPING) {
+        sleep_list_remove(thread);
+#endif
+    } else {
+        ready_list_remove(thread);
     }
+#if (DEADLOCK_DETECTION)
+    thread->LockPt = NULL;  // no longer part of the wait-for graph
+#endif
+    thread->status = DEAD;
+    thread_retire(thread);
     num_killed++;
     OSCRITICAL_EXIT();
     OS_Suspend();
 };
 
+// ******** OS_ThreadAlive ************
+// check whether a thread id belongs to a thread that has not been killed
+// input:  thread id
+// output: 1 if the thread is alive, 0 if there is no such thread
+int OS_ThreadAlive(uint32_t tid) {
+    int32_t sr;
+    OSCRITICAL_ENTER();
+    int alive = tid < MAX_THREADS && tcb_table[tid] != NULL && tcb_table[tid]->status != DEAD;
+    OSCRITICAL_EXIT();
+    return alive;
+}
+
+// ******** OS_StackUsed ************
+// deepest use of a thread's stack since it was added
+// input:  thread id
+// output: bytes used, -1 if there is no such thread or STACK_CHECK is 0
+int32_t OS_StackUsed(uint32_t tid) {
+#if (STACK_CHECK)
+    int32_t sr;
+    OSCRITICAL_ENTER();
+    TCB *thread = (tid < MAX_THREADS) ? tcb_table[tid] : NULL;
+    uint32_t *word = (thread != NULL) ? stack_bottom(thread) : NULL;
+    uint32_t *top = (thread != NULL) ? stack_top(thread) : NULL;
+    OSCRITICAL_EXIT();
+    if (thread == NULL) {
+        return -1;
+    }
+    // Chunks stay in the arena once their thread is killed, so the scan is
+    // safe even then, it just measures the stack of the next thread
+    while (word < top && *word == STACK_CANARY) {
+        word++;
+    }
+    return (top - word) * 4;
+#else
+    return -1;
+#endif
+}
+
+// ******** OS_StackDump ************
+// print the stack size and deepest use of every thread, and the overflows
+// input:  none
+// output: none
+void OS_StackDump(void) {
+    for (uint32_t tid = 0; tid < MAX_THREADS; tid++) {
+        int32_t sr;
+        OSCRITICAL_ENTER();
+        TCB *thread = tcb_table[tid];
+        uint32_t priority = (thread != NULL) ? thread->priority : 0;
+        uint32_t size = (thread != NULL) ? (stack_top(thread) - stack_bottom(thread)) * 4 : 0;
+        OSCRITICAL_EXIT();
+        if (thread == NULL) {
+            continue;
+        }
+        int32_t used = OS_StackUsed(tid);
+        if (used < 0) {
+            printf("thread %u: priority %u, stack %u bytes\r\n", tid, priority, size);
+        } else {
+            printf("thread %u: priority %u, stack %d of %u bytes used\r\n", tid, priority, (int)used, size);
+        }
+    }
+#if (STACK_CHECK)
+    printf("stack overflows: %u, last in thread %d\r\n", StackOverflows, (int)StackOverflowId);
+#endif
+}
+
 // ******** OS_Suspend ************
 // suspend execution of currently running thread
 // scheduler will choose another thread to execute
@@ -933,11 +1965,25 @@ void OS_Kill_Thread(uint32_t tid) {
 // input:  none
 // output: none
 void OS_Suspend(void) {
+#if (STACK_CHECK)
+    // The canary at the bottom is gone once the thread ran past its stack
+    uint32_t *bottom = stack_bottom(RunPt);
+    if (*bottom != STACK_CANARY) {
+        StackOverflows++;
+        StackOverflowId = RunPt->id;
+        *bottom = STACK_CANARY;  // so the next overrun is counted too
+    }
+#endif
     // Rotate current priority list
     if (PriorityPts[RunPt->priority] != NULL) {
         PriorityPts[RunPt->priority] = PriorityPts[RunPt->priority]->next;
     }
 
+#if (READY_BITMAP)
+    // Priority lists only hold ready threads, so the head of the highest
+    // non-empty list runs next. The idle thread keeps ReadyBits non-zero.
+    NextPt = PriorityPts[__builtin_clz(ReadyBits)];
+#else
     // Find next lowest priority
     uint32_t priority;
     for (priority = 0; priority < PRIORITY_LEVELS; priority++) {
@@ -961,62 +2007,169 @@ void OS_Suspend(void) {
     }
     // How to handle if all threads are inactive? Not sure if we need to consider this
     NextPt = PriorityPts[priority];
+#endif
+#if (STACK_MPU)
+    // Moving the guard before PendSV runs leaves the old thread unguarded
+    // for a few instructions, the new one is not running yet
+    NVIC_MPU_BASE_R = ((uint32_t)stack_bottom(NextPt) - 32) | NVIC_MPU_BASE_VALID | STACK_GUARD_REGION;
+#endif
     ContextSwitch();
 };
 
 // ******** OS_Fifo_Init ************
 // Initialize the Fifo to be empty
-// Inputs: size
+// Inputs: size, rounded up to a power of 2, from 2 to FIFO_MAX_SIZE
 // Outputs: none
-// In Lab 2, you can ignore the size field
-// In Lab 3, you should implement the user-defined fifo size
-// In Lab 3, you can put whatever restrictions you want on size
-//    e.g., 4 to 64 elements
-//    e.g., must be a power of 2,4,8,16,32,64,128
 void OS_Fifo_Init(uint32_t size) {
+    FifoSize = 2;
+    while (FifoSize < size && FifoSize < FIFO_MAX_SIZE) {
+        FifoSize *= 2;
+    }
+#if (FIFO_LOCKFREE)
+    FifoPut = FifoGet = 0;
+    FifoWaiting = 0;
+    OS_InitSemaphore(&FifoData, 0);
+#else
     PutPt = GetPt = &Fifo[0];           // set pointers to bottom
     OS_InitSemaphore(&CurrentSize, 0);  // curr size can be encapsulated in semaphore value
     OS_InitSemaphore(&FIFOmutex, 1);
+#endif
 };
 
+#if (FIFO_LOCKFREE)
+// Publishes the slots filled up to put and wakes the consumer if it waits
+void fifo_publish(uint32_t put) {
+#if (DEADLOCK_DETECTION)
+    // The producer is the only writer of its bit, so no critical section
+    sema_add_producer(&FifoData);
+#endif
+    FifoPut = put;
+    if (FifoWaiting) {
+        FifoWaiting = 0;
+        OS_Signal(&FifoData);
+    }
+}
+
+// Blocks the consumer until the Fifo holds data
+void fifo_wait(void) {
+    while (FifoPut == FifoGet) {
+        // A put after this check sees FifoWaiting and signals, the wait then
+        // returns at once if it comes first
+        int32_t sr;
+        OSCRITICAL_ENTER();
+        uint32_t empty = (FifoPut == FifoGet);
+        FifoWaiting = empty;
+        OSCRITICAL_EXIT();
+        if (empty) {
+            OS_Wait(&FifoData);
+        }
+    }
+}
+#endif
+
 // ******** OS_Fifo_Put ************
 // Enter one data sample into the Fifo
 // Called from the background, so no waiting
 // Inputs:  data
 // Outputs: true if data is properly saved,
 //          false if data not saved, because it was full
-// Since this is called by interrupt handlers
-//  this function can not disable or enable interrupts
 int OS_Fifo_Put(uint32_t data) {
-    if (CurrentSize.Value == FIFOSIZE) {
+#if (FIFO_LOCKFREE)
+    uint32_t put = FifoPut;
+    if (put - FifoGet == FifoSize) {
+        return 0;
+    }
+    Fifo[put & (FifoSize - 1)] = data;
+    fifo_publish(put + 1);
+#else
+    if (CurrentSize.Value == FifoSize) {
         return 0;
     }
     *(PutPt) = data;  // Put
     PutPt++;          // place to put next
-    if (PutPt == &Fifo[FIFOSIZE]) {
+    if (PutPt == &Fifo[FifoSize]) {
         PutPt = &Fifo[0];  // wrap
     }
     OS_Signal(&CurrentSize);  // Increments size and alerts readers
+#endif
     return 1;
 };
 
+// ******** OS_Fifo_PutN ************
+// Enter up to n data samples into the Fifo, in order
+// Inputs:  data, number of samples
+// Outputs: number of samples saved
+uint32_t OS_Fifo_PutN(const uint32_t *data, uint32_t n) {
+#if (FIFO_LOCKFREE)
+    uint32_t put = FifoPut;
+    uint32_t room = FifoSize - (put - FifoGet);
+    n = (n < room) ? n : room;
+    if (n == 0) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        Fifo[(put + i) & (FifoSize - 1)] = data[i];
+    }
+    fifo_publish(put + n);  // one index store and at most one signal for the batch
+    return n;
+#else
+    uint32_t i;
+    for (i = 0; i < n && OS_Fifo_Put(data[i]); i++) {
+    }
+    return i;
+#endif
+}
+
 // ******** OS_Fifo_Get ************
 // Remove one data sample from the Fifo
 // Called in foreground, will spin/block if empty
 // Inputs:  none
 // Outputs: data
 uint32_t OS_Fifo_Get(void) {
+#if (FIFO_LOCKFREE)
+    fifo_wait();
+    uint32_t get = FifoGet;
+    uint32_t data = Fifo[get & (FifoSize - 1)];
+    FifoGet = get + 1;  // the producer may reuse the slot now
+#else
     OS_Wait(&CurrentSize);     // Waits if empty, decrements size once data available
     OS_bWait(&FIFOmutex);      // Exclusive read access
     uint32_t data = *(GetPt);  // get data
     GetPt++;                   // points to next data to get
-    if (GetPt == &Fifo[FIFOSIZE]) {
+    if (GetPt == &Fifo[FifoSize]) {
         GetPt = &Fifo[0];  // wrap
     }
     OS_bSignal(&FIFOmutex);
+#endif
     return data;
 };
 
+// ******** OS_Fifo_GetN ************
+// Remove up to n data samples from the Fifo, in order
+// Called in foreground, blocks while the Fifo is empty
+// Inputs:  buffer for the samples, its size n, at least 1
+// Outputs: number of samples removed
+uint32_t OS_Fifo_GetN(uint32_t *data, uint32_t n) {
+#if (FIFO_LOCKFREE)
+    fifo_wait();
+    uint32_t get = FifoGet;
+    uint32_t count = FifoPut - get;
+    n = (n < count) ? n : count;
+    for (uint32_t i = 0; i < n; i++) {
+        data[i] = Fifo[(get + i) & (FifoSize - 1)];
+    }
+    FifoGet = get + n;
+    return n;
+#else
+    uint32_t i = 0;
+    data[i++] = OS_Fifo_Get();
+    while (i < n && OS_Fifo_Size() > 0) {
+        data[i++] = OS_Fifo_Get();
+    }
+    return i;
+#endif
+}
+
 // ******** OS_Fifo_Size ************
 // Check the status of the Fifo
 // Inputs: none
@@ -1025,7 +2178,11 @@ uint32_t OS_Fifo_Get(void) {
 //          zero or less than zero if the Fifo is empty
 //          zero or less than zero if a call to OS_Fifo_Get will spin or block
 int32_t OS_Fifo_Size(void) {
+#if (FIFO_LOCKFREE)
+    return FifoPut - FifoGet;
+#else
     return CurrentSize.Value;
+#endif
 };
 
 // Assume Mailbox used by Foreground threads only
@@ -1046,9 +2203,9 @@ void OS_MailBox_Init(void) {
 // This function will be called from a foreground thread
 // It will spin/block if the MailBox contains data not yet received
 void OS_MailBox_Send(uint32_t data) {
-    OS_bWait(&BoxFree);
+    OS_Wait(&BoxFree);
     Mail = data;
-    OS_bSignal(&MailValid);
+    OS_Signal(&MailValid);
 };
 
 // ******** OS_MailBox_Recv ************
@@ -1058,9 +2215,9 @@ void OS_MailBox_Send(uint32_t data) {
 // This function will be called from a foreground thread
 // It will spin/block if the MailBox is empty
 uint32_t OS_MailBox_Recv(void) {
-    OS_bWait(&MailValid);
+    OS_Wait(&MailValid);
     uint32_t data = Mail;
-    OS_bSignal(&BoxFree);
+    OS_Signal(&BoxFree);
     return data;
 };
 
@@ -1072,8 +2229,12 @@ uint32_t OS_MailBox_Recv(void) {
 // It is ok to change the resolution and precision of this function as long as
 //   this function and OS_TimeDifference have the same resolution and precision
 uint32_t OS_Time(void) {
+#if (OS_HOSTED)
+    return (uint32_t)Host_Cycles();
+#else
     // Reload value - Current value = Elapsed time since last reload
     return TIMER2_TAILR_R - TIMER2_TAV_R;
+#endif
 };
 
 // ******** OS_TimeDifference ************
@@ -1084,12 +2245,17 @@ uint32_t OS_Time(void) {
 // It is ok to change the resolution and precision of this function as long as
 //   this function and OS_Time have the same resolution and precision
 uint32_t OS_TimeDifference(uint32_t start, uint32_t stop) {
+#if (OS_HOSTED)
+    // Host time is a free running 32-bit counter, so unsigned wrap around is exact
+    return stop - start;
+#else
     if (start <= stop) {
         return stop - start;
     } else {
         // Wrap around computation
         return (TIMER2_TAILR_R - start) + stop;
     }
+#endif
 };
 
 //***OSMs Task***
@@ -1097,6 +2263,30 @@ uint32_t time;
 void OS_MsTask(void) {
     time++;
 
+    // Timed waits count down like the sleep queue
+    if (TimeoutPt != NULL) {
+        TimeoutPt->timeoutCount--;
+        while (TimeoutPt != NULL && TimeoutPt->timeoutCount == 0) {
+            TCB *thread = TimeoutPt;
+            TimeoutPt = thread->timeoutNext;
+            thread->timed = 0;
+            sema_wait_abort(thread, OS_WAIT_TIMEOUT);
+        }
+    }
+
+#if (READY_BITMAP)
+    // Only the head of the sleep queue counts down, nothing to do if it is empty
+    if (SleepPt != NULL) {
+        SleepPt->sleepCount--;
+        while (SleepPt != NULL && SleepPt->sleepCount == 0) {
+            // Move thread from the sleep queue back to its priority list
+            TCB *thread = SleepPt;
+            SleepPt = tcb_list_remove(thread);
+            thread->status = ACTIVE;
+            ready_list_add(thread);
+        }
+    }
+#else
     for (uint32_t priority = 0; priority < PRIORITY_LEVELS; priority++) {
         TCB *curr = PriorityPts[priority];
         if (curr != NULL) {
@@ -1111,6 +2301,7 @@ void OS_MsTask(void) {
             } while (curr != PriorityPts[priority]);
         }
     }
+#endif
 }
 // ******** OS_ClearMsTime ************
 // sets the system time to zero (solve for Lab 1), and start a periodic interrupt
@@ -1145,12 +2336,25 @@ uint32_t OS_MsTime(void) {
 // It is ok to limit the range of theTimeSlice to match the 24-bit SysTick
 void OS_Launch(uint32_t theTimeSlice) {
     // put Lab 2 (and beyond) solution here
+#if (OS_HOSTED)
+    Host_SysTickInit(&SysTick_Handler, theTimeSlice);
+#else
     STCTRL = 0;                                     // disable SysTick during setup
     STCURRENT = 0;                                  // any write to current clears it
     SYSPRI3 = (SYSPRI3 & 0x00FFFFFF) | 0xE0000000;  // systick priority 7
     SYSPRI3 = (SYSPRI3 & 0xFF00FFFF) | 0x00E00000;  // pendsv priority 7
     STRELOAD = theTimeSlice - 1;                    // reload value
     STCTRL = 0x00000007;                            // enable, core clock and interrupt arm
+#if (STACK_MPU)
+    // 32 byte region (size field log2(32) - 1) with no access and no execution,
+    // the rest of memory behaves as without the MPU
+    NVIC_MPU_NUMBER_R = STACK_GUARD_REGION;
+    NVIC_MPU_BASE_R = ((uint32_t)stack_bottom(RunPt) - 32) | NVIC_MPU_BASE_VALID | STACK_GUARD_REGION;
+    NVIC_MPU_ATTR_R = NVIC_MPU_ATTR_XN | (4 << 1) | NVIC_MPU_ATTR_ENABLE;
+    NVIC_MPU_CTRL_R = NVIC_MPU_CTRL_PRIVDEFEN | NVIC_MPU_CTRL_ENABLE;
+    NVIC_SYS_HND_CTRL_R |= NVIC_SYS_HND_CTRL_MEM;  // overflows fault in MemManage_Handler
+#endif
+#endif
     OS_ClearMsTime();
     StartOS();  // start on the first task
 };
@@ -1160,6 +2364,17 @@ void OS_Launch(uint32_t theTimeSlice) {
 
 int StreamToDevice = 0;  // 0=UART, 1=stream to file (Lab 4)
 
+#if (OS_HOSTED)
+// printf already goes to stdout on the host, and there is no disk to redirect to
+int OS_RedirectToFile(const char *name) {
+    return 1;
+}
+
+int OS_EndRedirectToFile(void) {
+    return 0;
+}
+#else
+
 int fputc(int ch, FILE *f) {
     if (StreamToDevice == 1) {       // Lab 4
         if (eFile_Write(ch)) {       // close file on error
@@ -1194,6 +2409,7 @@ int OS_EndRedirectToFile(void) {  // Lab 4
         return 1;  // cannot close file
     return 0;
 }
+#endif
 
 int OS_RedirectToUART(void) {
     StreamToDevice = 0;
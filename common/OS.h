@@ -27,15 +27,108 @@
 #define PRIORITY_LEVELS 7
 
 // Thread and stack size configuration
-#define MAX_THREADS 9
-#define STACK_SIZE 128
+// TCBs and stacks are taken from one arena as threads are added, so
+// MAX_THREADS only bounds the thread ids, each costing a few words of tables.
+// It is set above what the arena holds, so memory limits the threads.
+#ifndef MAX_THREADS
+#define MAX_THREADS 32
+#endif
+#if (MAX_THREADS > 256)
+#error "thread ids must fit in a byte"
+#endif
+#ifndef STACK_ARENA_WORDS
+#define STACK_ARENA_WORDS 1536  // TCBs and stacks of all threads
+#endif
+#define STACK_MIN_WORDS 32      // stacks are multiples of this, room for the saved registers and an interrupt
+#ifndef STACK_MAX_WORDS
+#define STACK_MAX_WORDS 1024
+#endif
+
+// Largest OS_Fifo_Init size, the FIFO's storage is reserved for it
+#ifndef FIFO_MAX_SIZE
+#define FIFO_MAX_SIZE 128
+#endif
+
+// Single producer, single consumer ring with no lock on its common path,
+// the consumer's semaphore is only signalled when it waits on an empty FIFO.
+// 0 selects the original FIFO, a counting semaphore signalled on every put
+// and a mutex around every get.
+#ifndef FIFO_LOCKFREE
+#define FIFO_LOCKFREE 1
+#endif
+
+// Target only, let threads use the FPU. A thread's floating point registers
+// are saved at a switch only once it has used the FPU, so integer threads
+// switch as fast as without it. 0 leaves the FPU off, so floating point
+// instructions fault. On by default when the compiler generates FPU code,
+// which the project's Floating Point Hardware setting selects for the
+// assembler too.
+#ifndef OS_FPU
+#if defined(__ARM_FP) || defined(__TARGET_FPU_VFP)
+#define OS_FPU 1
+#else
+#define OS_FPU 0
+#endif
+#endif
+
+// Paint each stack with STACK_CANARY when its thread is added, so the deepest
+// use of a stack can be measured later and a thread that wrote over the
+// bottom word is counted at the next switch away from it, 0 disables
+#ifndef STACK_CHECK
+#define STACK_CHECK 1
+#endif
+#define STACK_CANARY 0xDEADBEEF
+
+// Target only, make the lowest 32 bytes of the running thread's stack an MPU
+// region nothing may access, so an overflow faults on the first word written.
+// The region takes up to 16 more words of every stack, 0 disables
+#ifndef STACK_GUARD
+#define STACK_GUARD 0
+#endif
+
+// Keep sleeping threads out of the priority lists and find the highest ready
+// priority with one CLZ on a bitmap, 0 selects the original list scan
+#ifndef READY_BITMAP
+#define READY_BITMAP 1
+#endif
 
 #define MAX_PROCESSES 1
 
+// Build the kernel as an ordinary Linux process (see host/) instead of for the TM4C
+#ifndef OS_HOSTED
+#define OS_HOSTED 0
+#endif
+
 #define DEADLOCK_DETECTION 1
 #define DEADLOCK_CHECK_PERIOD_MS 3000
 #define DEADLOCK_PRINTS 1
 
+// Check the wait-for graph in OS_LockAcquire, so a cycle is found when the edge
+// closing it is added. The periodic check then only acts as a fallback.
+#ifndef DEADLOCK_INCREMENTAL
+#define DEADLOCK_INCREMENTAL 1
+#endif
+
+// Which thread of a cycle is killed to break a deadlock, the detector then
+// checks again and picks another victim if the cycle is still there.
+// The victim is the cheapest by the policy, OS_DeadlockVictimCost replaces it.
+#define VICTIM_ALL 0          // kill every thread in the cycle
+#define VICTIM_PRIORITY 1     // lowest priority
+#define VICTIM_YOUNGEST 2     // started waiting last
+#define VICTIM_FEWEST_LOCKS 3 // holds the fewest Locks and binary semaphores
+#ifndef DEADLOCK_VICTIM
+#define DEADLOCK_VICTIM VICTIM_YOUNGEST
+#endif
+
+// Lock holders run at the priority of their highest priority waiter, passed
+// on along chains of Lock waits. Needs the lock lists of DEADLOCK_DETECTION.
+#ifndef LOCK_PRIORITY_INHERITANCE
+#define LOCK_PRIORITY_INHERITANCE DEADLOCK_DETECTION
+#endif
+#if (LOCK_PRIORITY_INHERITANCE && !DEADLOCK_DETECTION)
+#error "LOCK_PRIORITY_INHERITANCE needs DEADLOCK_DETECTION"
+#endif
+
 // Forward definitions
 struct TCB;
 typedef struct TCB TCB;
@@ -49,6 +142,13 @@ typedef struct PCB PCB;
 struct Sema4 {
     int32_t Value;                     // >0 means free, otherwise means busy
     TCB *BlockedPts[PRIORITY_LEVELS];  // List for each priority level of blocked threads#
+#if (DEADLOCK_DETECTION)
+    // Who can end a wait on this semaphore, see the wait-for graph in OS.c
+    TCB *holder;                                  // owner between OS_bWait and OS_bSignal
+    struct Sema4 *next;                           // list of binary semaphores a thread holds
+    uint32_t producers[(MAX_THREADS + 31) / 32];  // bit per thread id that can signal it
+    uint8_t background;                           // signalled by an interrupt handler
+#endif
 };
 typedef struct Sema4 Sema4Type;
 
@@ -61,6 +161,32 @@ struct Lock {
 };
 typedef struct Lock Lock;
 
+// Fixed size object pool, see OS_PoolInit
+struct Pool {
+    void *head;       // oldest free block, free blocks are linked through their first word
+    void *tail;       // newest free block
+    uint8_t *blocks;  // count blocks of size bytes
+    uint32_t size;
+    uint32_t count;
+    Sema4Type free;  // free blocks not yet promised to a caller of OS_PoolAlloc
+};
+typedef struct Pool PoolType;
+
+// Named message queue of fixed size elements, see OS_QueueInit
+struct Queue {
+    const char *name;
+    uint8_t *buffer;     // depth elements of size bytes
+    uint32_t size;
+    uint32_t depth;
+    uint32_t put;        // slot the next element is copied to
+    uint32_t get;        // slot of the oldest element
+    uint32_t count;      // elements in the buffer
+    Sema4Type items;     // elements not yet promised to a receiver
+    Sema4Type slots;     // free slots not yet promised to a sender
+    struct Queue *next;  // queues OS_QueueFind searches
+};
+typedef struct Queue QueueType;
+
 // Thread status
 enum Status {
     DEAD,
@@ -72,20 +198,34 @@ enum Status {
 // Thread Control Block
 struct TCB {
     uint32_t *sp;
+    uint32_t stackWords;  // size of the stack after the TCB in the stack arena
     struct TCB *next;
     struct TCB *prev;
     uint32_t id;
     struct PCB *process;
     uint32_t priority;
+#if (LOCK_PRIORITY_INHERITANCE)
+    uint32_t basePriority;  // priority given to OS_AddThread, priority may be inherited
+#endif
     uint32_t sleepCount;
     Sema4Type *SemaPt;
+    struct TCB *timeoutNext;  // list of timed waits, sorted by expiry
+    uint32_t timeoutCount;    // delta like sleepCount
+    uint8_t timed;            // in the timed wait list
+    int32_t waitResult;       // OS_WAIT_OK, OS_WAIT_TIMEOUT or OS_WAIT_DEADLOCK
 #if (DEADLOCK_DETECTION)
     uint32_t lockStart;
     Lock *LockPt;
     Lock *acquired;
+    Sema4Type *held;  // binary semaphores taken with OS_bWait
     uint8_t visited;
+    uint8_t abortable;      // in OS_WaitTimeout, recovery aborts the wait instead of killing
+    void (*cleanup)(void);  // undoes the work of an aborted OS_LockAcquireTimeout
 #endif
     enum Status status;
+#if (OS_HOSTED)
+    void *context;  // host execution context, replaces the stack frame built in the stack arena
+#endif
 };
 
 // Process Control Block
@@ -121,6 +261,20 @@ void OS_InitSemaphore(Sema4Type *semaPt, int32_t value);
 // output: none
 void OS_Wait(Sema4Type *semaPt);
 
+// Results of the waits that can fail
+#define OS_WAIT_OK 0
+#define OS_WAIT_TIMEOUT 1   // the timeout expired first
+#define OS_WAIT_DEADLOCK 2  // aborted by deadlock recovery, back off and retry
+#define OS_FOREVER 0xFFFFFFFF
+
+// ******** OS_WaitTimeout ************
+// decrement semaphore, blocking for at most timeout ms
+// Deadlock recovery picks threads in this wait as victims first and ends
+// the wait with an error instead of killing them
+// input:  pointer to a counting semaphore, timeout in ms (0 only tries, OS_FOREVER never expires)
+// output: OS_WAIT_OK, OS_WAIT_TIMEOUT or OS_WAIT_DEADLOCK
+int OS_WaitTimeout(Sema4Type *semaPt, uint32_t timeout);
+
 // ******** OS_Signal ************
 // increment semaphore
 // Lab2 spinlock
@@ -138,6 +292,8 @@ void OS_SignalAll(Sema4Type *semaPt);
 // ******** OS_bWait ************
 // Lab2 spinlock, set to 0
 // Lab3 block if less than zero
+// The calling thread owns the semaphore until it calls OS_bSignal,
+// use OS_Wait/OS_Signal to signal between threads
 // input:  pointer to a binary semaphore
 // output: none
 void OS_bWait(Sema4Type *semaPt);
@@ -149,6 +305,14 @@ void OS_bWait(Sema4Type *semaPt);
 // output: none
 void OS_bSignal(Sema4Type *semaPt);
 
+// ******** OS_SemaphoreProducer ************
+// Tells deadlock detection whether a thread can signal a counting semaphore
+// Threads that call OS_Signal are added automatically, this is for protocols
+// that know their signallers up front or can tell when one is done
+// input:  pointer to a counting semaphore, thread id, 1 to add or 0 to remove
+// output: none
+void OS_SemaphoreProducer(Sema4Type *semaPt, uint32_t tid, int producer);
+
 // Initializes a Lock instance
 // Input: Pointer to a Lock instance
 // Output: None
@@ -159,6 +323,23 @@ void OS_InitLock(Lock *lock);
 // Output: None
 void OS_LockAcquire(Lock *lock);
 
+// Acquires the lock, giving up after timeout ms or when deadlock recovery
+// picks the caller as its victim. In that case the cleanup handler runs
+// and every Lock the caller still holds is released before returning.
+// Input: Pointer to a Lock instance, timeout in ms (0 only tries, OS_FOREVER never expires)
+// Output: OS_WAIT_OK if acquired, OS_WAIT_TIMEOUT or OS_WAIT_DEADLOCK
+int OS_LockAcquireTimeout(Lock *lock, uint32_t timeout);
+
+// Acquires the lock unless deadlock recovery aborts the wait
+// Input: Pointer to a Lock instance
+// Output: OS_WAIT_OK if acquired, OS_WAIT_DEADLOCK
+int OS_LockAcquireAbortable(Lock *lock);
+
+// Sets the handler that rolls back the calling thread's work when one of its
+// lock waits is aborted, before its locks are released
+// Input: handler, NULL for none
+void OS_LockCleanup(void (*cleanup)(void));
+
 // Releases the lock
 // Input: Pointer to a Lock instance
 // Output:
@@ -166,15 +347,89 @@ void OS_LockAcquire(Lock *lock);
 //   - Error code if the thread doesn't hold the lock
 int OS_LockRelease(Lock *lock);
 
+// ******** OS_PoolInit ************
+// Makes a pool of count blocks of size bytes out of memory the caller owns,
+// usually an array of the objects, see OS_PoolInitArray
+// A free block holds the link to the next one in its first word, so
+// blocks must be pointer aligned and at least a pointer big.
+// input:  pointer to the pool, blocks, size of a block in bytes, number of blocks
+// output: 1 if successful, 0 if the blocks cannot hold the links
+int OS_PoolInit(PoolType *pool, void *blocks, uint32_t size, uint32_t count);
+
+// OS_PoolInit for every element of an array
+#define OS_PoolInitArray(pool, array) \
+    OS_PoolInit((pool), (array), sizeof((array)[0]), sizeof(array) / sizeof((array)[0]))
+
+// ******** OS_PoolAlloc ************
+// Takes a block out of the pool in constant time, the one freed longest ago
+// Waits at most timeout ms for a block to be freed, interrupt handlers may
+// only use a timeout of 0
+// input:  pointer to the pool, timeout in ms (0 only tries, OS_FOREVER never expires)
+// output: the block, contents undefined, NULL if none became free in time
+void *OS_PoolAlloc(PoolType *pool, uint32_t timeout);
+
+// OS_PoolAlloc returning a pointer to type
+#define OS_PoolNew(pool, type, timeout) ((type *)OS_PoolAlloc((pool), (timeout)))
+
+// ******** OS_PoolFree ************
+// Gives a block back to its pool in constant time, waking a thread waiting in
+// OS_PoolAlloc. May be called from interrupt handlers.
+// input:  pointer to the pool, block from OS_PoolAlloc
+// output: 1 if successful, 0 if block is not one of the pool's
+int OS_PoolFree(PoolType *pool, void *block);
+
+// ******** OS_QueueInit ************
+// Makes a queue of depth elements of size bytes in a buffer the caller owns,
+// usually an array of the element type, see OS_QueueInitArray. The queue can
+// then be found by name, which should be unique. Elements are copied in and
+// out with interrupts disabled, so they should be a few words at most.
+// input:  pointer to the queue, name, buffer, size of an element in bytes, depth
+// output: 1 if successful, 0 if the buffer or a size is missing
+int OS_QueueInit(QueueType *queue, const char *name, void *buffer, uint32_t size, uint32_t depth);
+
+// OS_QueueInit with one element per entry of an array
+#define OS_QueueInitArray(queue, name, array) \
+    OS_QueueInit((queue), (name), (array), sizeof((array)[0]), sizeof(array) / sizeof((array)[0]))
+
+// ******** OS_QueueFind ************
+// Returns the queue initialized with a name, NULL if there is none
+// input:  name
+// output: the queue
+QueueType *OS_QueueFind(const char *name);
+
+// ******** OS_QueueSend ************
+// Copies an element to the back of the queue, waiting at most timeout ms for
+// room. Interrupt handlers may only use a timeout of 0, see OS_QueueSendFromISR.
+// input:  pointer to the queue, element, timeout in ms (0 only tries, OS_FOREVER never expires)
+// output: OS_WAIT_OK, OS_WAIT_TIMEOUT if the queue stayed full or OS_WAIT_DEADLOCK
+int OS_QueueSend(QueueType *queue, const void *msg, uint32_t timeout);
+
+// OS_QueueSend from an interrupt handler, fails at once if the queue is full
+#define OS_QueueSendFromISR(queue, msg) OS_QueueSend((queue), (msg), 0)
+
+// ******** OS_QueueReceive ************
+// Copies the oldest element out of the queue, waiting at most timeout ms for one
+// input:  pointer to the queue, buffer for the element, timeout in ms (0 only tries, OS_FOREVER never expires)
+// output: OS_WAIT_OK, OS_WAIT_TIMEOUT if the queue stayed empty or OS_WAIT_DEADLOCK
+int OS_QueueReceive(QueueType *queue, void *msg, uint32_t timeout);
+
+// ******** OS_QueueCount ************
+// Returns the number of elements in the queue, including any a receiver
+// was woken for but has not copied out yet
+// input:  pointer to the queue
+// output: number of elements
+uint32_t OS_QueueCount(QueueType *queue);
+
 //******** OS_AddThread ***************
 // add a foregound thread to the scheduler
 // Inputs: pointer to a void/void foreground task
 //         number of bytes allocated for its stack
 //         priority, 0 is highest, 5 is the lowest
 // Outputs: 1 if successful, 0 if this thread can not be added
-// stack size must be divisable by 8 (aligned to double word boundary)
-// In Lab 2, you can ignore both the stackSize and priority fields
-// In Lab 3, you can ignore the stackSize fields
+// The stack is rounded up to a multiple of STACK_MIN_WORDS words, at most
+// STACK_MAX_WORDS, and taken from the stack arena with the TCB
+// A thread that uses the FPU needs 34 more words of stack, for the
+// floating point registers stacked when it is switched out
 int OS_AddThread(void (*task)(void),
                  uint32_t stackSize, uint32_t priority);
 
@@ -184,6 +439,19 @@ int OS_AddThread(void (*task)(void),
 // Outputs: Thread ID, number greater than zero
 uint32_t OS_Id(void);
 
+//******** OS_TryId ***************
+// returns the thread ID for the currently running thread, if there is one
+// Inputs: none
+// Outputs: same as OS_Id in a thread, -1 in an interrupt handler or
+//          before the first thread is added
+int32_t OS_TryId(void);
+
+//******** OS_Priority ***************
+// returns the priority of the currently running thread, 0 is highest
+// Inputs: none
+// Outputs: current priority, including any inherited priority
+uint32_t OS_Priority(void);
+
 //******** OS_AddPeriodicThread ***************
 // add a background periodic task
 // typically this function receives the highest priority
@@ -254,6 +522,33 @@ void OS_Kill(void);
 // output: none
 void OS_Kill_Thread(uint32_t tid);
 
+// ******** OS_ThreadAlive ************
+// check whether a thread id belongs to a thread that has not been killed
+// input:  thread id
+// output: 1 if the thread is alive, 0 if there is no such thread
+int OS_ThreadAlive(uint32_t tid);
+
+// ******** OS_StackUsed ************
+// deepest use of a thread's stack since it was added, found by looking for
+// the lowest word that no longer holds STACK_CANARY
+// input:  thread id
+// output: bytes used, -1 if there is no such thread or STACK_CHECK is 0
+int32_t OS_StackUsed(uint32_t tid);
+
+// ******** OS_StackDump ************
+// print the stack size and deepest use of every thread, and the overflows
+// found so far. Each stack is scanned with interrupts enabled.
+// input:  none
+// output: none
+void OS_StackDump(void);
+
+// ******** OS_DeadlockVictimCost ************
+// Sets how deadlock recovery picks its victim, the thread of the cycle with
+// the lowest cost is killed. Called with interrupts disabled, must not block.
+// input:  cost of killing a thread given its id, NULL restores DEADLOCK_VICTIM
+// output: none
+void OS_DeadlockVictimCost(uint32_t (*cost)(uint32_t tid));
+
 // ******** OS_Suspend ************
 // suspend execution of currently running thread
 // scheduler will choose another thread to execute
@@ -270,13 +565,10 @@ void OS_UnLockScheduler(unsigned long previous);
 
 // ******** OS_Fifo_Init ************
 // Initialize the Fifo to be empty
-// Inputs: size
+// Inputs: size, rounded up to a power of 2, from 2 to FIFO_MAX_SIZE
 // Outputs: none
-// In Lab 2, you can ignore the size field
-// In Lab 3, you should implement the user-defined fifo size
-// In Lab 3, you can put whatever restrictions you want on size
-//    e.g., 4 to 64 elements
-//    e.g., must be a power of 2,4,8,16,32,64,128
+// With FIFO_LOCKFREE only one thread or interrupt handler may put and only
+// one thread may get
 void OS_Fifo_Init(uint32_t size);
 
 // ******** OS_Fifo_Put ************
@@ -289,6 +581,13 @@ void OS_Fifo_Init(uint32_t size);
 //  this function can not disable or enable interrupts
 int OS_Fifo_Put(uint32_t data);
 
+// ******** OS_Fifo_PutN ************
+// Enter up to n data samples into the Fifo, in order
+// Called from the background, so no waiting
+// Inputs:  data, number of samples
+// Outputs: number of samples saved, fewer than n once the Fifo is full
+uint32_t OS_Fifo_PutN(const uint32_t *data, uint32_t n);
+
 // ******** OS_Fifo_Get ************
 // Remove one data sample from the Fifo
 // Called in foreground, will spin/block if empty
@@ -296,6 +595,13 @@ int OS_Fifo_Put(uint32_t data);
 // Outputs: data
 uint32_t OS_Fifo_Get(void);
 
+// ******** OS_Fifo_GetN ************
+// Remove up to n data samples from the Fifo, in order
+// Called in foreground, blocks while the Fifo is empty
+// Inputs:  buffer for the samples, its size n, at least 1
+// Outputs: number of samples removed, at least 1
+uint32_t OS_Fifo_GetN(uint32_t *data, uint32_t n);
+
 // ******** OS_Fifo_Size ************
 // Check the status of the Fifo
 // Inputs: none
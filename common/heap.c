@@ -32,8 +32,22 @@
 // If the block is used, the meta-sections record the room as a positive
 // number.  If the block is unused, the meta-sections record the room as a
 // negative number.
+// With HEAP_TLSF the unused blocks are also kept in two-level segregated fit
+// lists: an unused block of room r is in list (fl, sl), fl from the top bit of
+// r and sl from the TLSF_SL_LOG2 bits below it. A bitmap per level marks the
+// lists that are not empty, so finding a block big enough takes two find
+// first set instructions instead of a scan. An unused block keeps the heap
+// indices of the next and previous blocks of its list in its first two words.
+// Interrupts are disabled while a block is taken or given back. A block of a
+// cache class freed by a thread goes to the thread's cache instead, a list
+// linked through the first word of the blocks that only the thread touches.
+// With HEAP_PROFILE each Heap_Malloc is counted against its return address,
+// looked up in a small open addressing table.
 #include <stdint.h>
+#include <stdio.h>
 #include "heap.h"
+#include "OS.h"
+#include "../inc/CortexM.h"
 
 #define HEAP_START (Heap)
 #define HEAP_END (HEAP_START + HEAP_SIZE_WORDS)
@@ -41,6 +55,89 @@
 // The actual heap is just a big array.
 static int32_t Heap[HEAP_SIZE_WORDS];
 
+#if (HEAP_TLSF)
+#define TLSF_SL_LOG2 3
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_FL_COUNT 16 // rooms below 2^(TLSF_FL_COUNT + TLSF_SL_LOG2 - 1) words
+#define TLSF_NONE (-1)   // end of a list
+#define HEAP_MIN_ROOM 2  // an unused block holds its list links
+#if (HEAP_SIZE_BYTES / 4 >= (1 << (TLSF_FL_COUNT + TLSF_SL_LOG2 - 1)))
+#error "HEAP_SIZE_BYTES too big for TLSF_FL_COUNT"
+#endif
+
+#if defined(__GNUC__)
+#define tlsfFls(x) (31 - __builtin_clz(x))
+#else
+#define tlsfFls(x) (31 - __clz(x)) // one CLZ instruction on the Cortex M4
+#endif
+#define tlsfFfs(x) tlsfFls((x) & -(x))
+
+static uint32_t FreeFL;                               // bit fl set if a list (fl, *) is not empty
+static uint32_t FreeSL[TLSF_FL_COUNT];                // bit sl set if list (fl, sl) is not empty
+static int32_t FreeHead[TLSF_FL_COUNT][TLSF_SL_COUNT]; // first block of each list, TLSF_NONE if empty
+
+static void tlsfMapping(int32_t room, int32_t *fl, int32_t *sl);
+static void tlsfInsert(int32_t *blockStart);
+static void tlsfRemove(int32_t *blockStart);
+static int32_t *tlsfFind(int32_t desiredRoom);
+#if (HEAP_PROFILE)
+static int32_t tlsfLargest(void);
+#endif
+#else
+#define HEAP_MIN_ROOM 1
+#endif
+
+#if (HEAP_CACHE_DEPTH)
+#define HEAP_CACHE_ROOM(cls) (2 << (cls)) // room of the blocks of a cache class
+#define CACHE_NONE (-1)                   // end of a cache
+#define CACHE_TAG 0x0CAC4ED0              // second word of a cached block, the first links the cache
+
+static int32_t CacheHead[MAX_THREADS][HEAP_CACHE_CLASSES]; // first block, CACHE_NONE if empty
+static uint8_t CacheCount[MAX_THREADS][HEAP_CACHE_CLASSES];
+
+static int32_t cacheClass(int32_t room);
+static int32_t cacheHolds(int32_t cls, int32_t index);
+#endif
+
+#if (HEAP_PROFILE)
+#if defined(__GNUC__)
+#define HEAP_CALLER() __builtin_return_address(0)
+#else
+#define HEAP_CALLER() ((void *)__return_address()) // armcc intrinsic
+#endif
+#define HEAP_OTHER_SITE (HEAP_PROFILE_SITES - 1) // calls from sites that found no free entry
+
+typedef struct heap_site
+{
+    void *site; // return address of the Heap_Malloc call, NULL if the entry is free
+    uint32_t calls;
+    uint32_t bytes; // total bytes asked for
+    uint32_t failed;
+    int32_t maxBytes; // biggest request
+} heap_site_t;
+
+static heap_site_t Sites[HEAP_PROFILE_SITES];
+static uint32_t MallocCycles[HEAP_PROFILE_BUCKETS];
+static uint32_t FreeCycles[HEAP_PROFILE_BUCKETS];
+
+static int32_t profileBucket(uint32_t cycles);
+static void profileMalloc(void *site, int32_t desiredBytes, void *block, uint32_t start);
+#else
+#define HEAP_CALLER() 0 // NULL
+#endif
+
+static int32_t LargestFreeLow; // see heap_stats_t
+
+static void *heapMalloc(int32_t desiredBytes, void *site);
+#if (HEAP_REALLOC_IN_PLACE)
+static int32_t *reallocInPlace(int32_t *blockStart, int32_t desiredBytes, void *site);
+#endif
+#if (HEAP_PROFILE && HEAP_TLSF)
+static void trackLargestFree(void);
+#endif
+static int32_t *allocateBlock(int32_t desiredWords);
+static int32_t freeBlock(int32_t *blockStart);
+static int32_t testHeap(void);
 static int32_t inHeapRange(int32_t *address);
 static int32_t blockUsed(int32_t *block);
 static int32_t blockUnused(int32_t *block);
@@ -68,6 +165,43 @@ int32_t Heap_Init(void)
     int32_t *blockEnd = (HEAP_START + HEAP_SIZE_WORDS - 1);
     *blockStart = -(int32_t)(HEAP_SIZE_WORDS - 2);
     *blockEnd = -(int32_t)(HEAP_SIZE_WORDS - 2);
+#if (HEAP_TLSF)
+    int32_t fl, sl;
+    FreeFL = 0;
+    for (fl = 0; fl < TLSF_FL_COUNT; fl++)
+    {
+        FreeSL[fl] = 0;
+        for (sl = 0; sl < TLSF_SL_COUNT; sl++)
+        {
+            FreeHead[fl][sl] = TLSF_NONE;
+        }
+    }
+    tlsfInsert(blockStart);
+#endif
+    LargestFreeLow = HEAP_SIZE_WORDS - 2;
+#if (HEAP_PROFILE)
+    int32_t i;
+    for (i = 0; i < HEAP_PROFILE_SITES; i++)
+    {
+        Sites[i] = (heap_site_t){0};
+    }
+    for (i = 0; i < HEAP_PROFILE_BUCKETS; i++)
+    {
+        MallocCycles[i] = 0;
+        FreeCycles[i] = 0;
+    }
+#endif
+#if (HEAP_CACHE_DEPTH)
+    int32_t thread, cls;
+    for (thread = 0; thread < MAX_THREADS; thread++)
+    {
+        for (cls = 0; cls < HEAP_CACHE_CLASSES; cls++)
+        {
+            CacheHead[thread][cls] = CACHE_NONE;
+            CacheCount[thread][cls] = 0;
+        }
+    }
+#endif
     return HEAP_OK;
 }
 
@@ -79,27 +213,61 @@ int32_t Heap_Init(void)
 //   if there isn't sufficient space to satisfy allocation request
 void *Heap_Malloc(int32_t desiredBytes)
 {
+    return heapMalloc(desiredBytes, HEAP_CALLER());
+}
+
+// heapMalloc
+// input: desired number of bytes, return address of the Heap_Malloc,
+//  Heap_Calloc or Heap_Realloc call
+// output: same as Heap_Malloc
+static void *heapMalloc(int32_t desiredBytes, void *site)
+{
+#if (HEAP_PROFILE)
+    uint32_t start = OS_Time();
+#endif
     int32_t desiredWords = (desiredBytes + sizeof(int32_t) - 1) / sizeof(int32_t);
-    int32_t *blockStart = HEAP_START; // implements first fit
+    int32_t *blockStart;
+    long sr;
     if (desiredWords <= 0)
     {
         return 0; // NULL
     }
-    while (inHeapRange(blockStart))
+#if (HEAP_CACHE_DEPTH)
+    int32_t cls = cacheClass(desiredWords);
+    if (cls >= 0)
     {
-        // one pass through the heap
-        // choose first block that is big enough
-        if (blockUnused(blockStart) && desiredWords <= blockRoom(blockStart))
+        int32_t thread = OS_TryId();
+        // round up, so the block can go back into a cache when freed
+        desiredWords = HEAP_CACHE_ROOM(cls);
+        if (thread >= 0 && CacheCount[thread][cls] > 0)
         {
-            if (splitAndMarkBlockUsed(blockStart, desiredWords))
-            {
-                return 0; // NULL
-            }
+            blockStart = HEAP_START + CacheHead[thread][cls];
+            CacheHead[thread][cls] = blockStart[1];
+            CacheCount[thread][cls]--;
+            blockStart[2] = 0; // no longer tagged as cached
+#if (HEAP_PROFILE)
+            sr = StartCritical();
+            profileMalloc(site, desiredBytes, blockStart, start);
+            EndCritical(sr);
+#endif
             return blockStart + 1;
         }
-        blockStart = nextBlockHeader(blockStart);
     }
-    return 0; // NULL
+#endif
+    sr = StartCritical();
+    blockStart = allocateBlock(desiredWords);
+#if (HEAP_PROFILE && HEAP_TLSF)
+    trackLargestFree();
+#endif
+#if (HEAP_PROFILE)
+    profileMalloc(site, desiredBytes, blockStart, start);
+#endif
+    EndCritical(sr);
+    if (blockStart == 0)
+    {
+        return 0; // NULL
+    }
+    return blockStart + 1;
 }
 
 //******** Heap_Calloc ***************
@@ -116,7 +284,7 @@ void *Heap_Calloc(int32_t desiredBytes)
     int32_t i;
 
     // malloc a block
-    blockPtr = Heap_Malloc(desiredBytes);
+    blockPtr = heapMalloc(desiredBytes, HEAP_CALLER());
     // did malloc fail?
     if (blockPtr == 0)
     {
@@ -139,8 +307,10 @@ void *Heap_Calloc(int32_t desiredBytes)
 //    where the contents of the old block will be copied to
 // output: void* pointing to the new block or will return NULL
 //   if there is any reason the reallocation can't be completed
-// notes: the given block will be unallocated after its contents
-//   are copied to the new block
+// notes: the block is resized where it is if it shrinks or the block after
+//   it is unused and big enough, otherwise the contents are copied to a new
+//   block and the given block is unallocated. The given block is left
+//   as it was when NULL is returned.
 void *Heap_Realloc(void *oldBlock, int32_t desiredBytes)
 {
     int32_t *oldBlockPtr;
@@ -150,6 +320,7 @@ void *Heap_Realloc(void *oldBlock, int32_t desiredBytes)
     int32_t newBlockRoom;
     int32_t wordsToCopy;
     int32_t i;
+    void *site = HEAP_CALLER();
 
     oldBlockPtr = (int32_t *)oldBlock;
     // error if...
@@ -161,7 +332,16 @@ void *Heap_Realloc(void *oldBlock, int32_t desiredBytes)
         return 0; // NULL
     }
 
-    newBlockPtr = Heap_Malloc(desiredBytes);
+#if (HEAP_REALLOC_IN_PLACE)
+    long sr = StartCritical();
+    newBlockPtr = reallocInPlace(oldBlockStart, desiredBytes, site);
+    EndCritical(sr);
+    if (newBlockPtr != 0)
+    {
+        return newBlockPtr;
+    }
+#endif
+    newBlockPtr = heapMalloc(desiredBytes, site);
     // did Malloc fail?
     if (newBlockPtr == 0)
     {
@@ -198,53 +378,80 @@ void *Heap_Realloc(void *oldBlock, int32_t desiredBytes)
 //  unallocate memory that has already been unallocated;
 int32_t Heap_Free(void *pointer)
 {
-    int32_t *blockStart;
-    int32_t *blockEnd;
-    int32_t *nextBlockStart;
-
-    blockStart = ((int32_t *)pointer) - 1;
-
-    //-----Begin error checking-------
-    if (!inHeapRange(blockStart))
+#if (HEAP_PROFILE)
+    uint32_t start = OS_Time();
+#endif
+    int32_t *blockStart = ((int32_t *)pointer) - 1;
+    int32_t status;
+    long sr;
+#if (HEAP_CACHE_DEPTH)
+    int32_t thread = OS_TryId();
+    if (inHeapRange(blockStart) && blockUsed(blockStart))
     {
-        return HEAP_ERROR_POINTER_OUT_OF_RANGE;
-    }
-    if (blockUnused(blockStart))
-    {
-        return HEAP_ERROR_CORRUPTED_HEAP;
-    }
-    blockEnd = blockTrailer(blockStart);
-    if (!inHeapRange(blockEnd) || blockUnused(blockEnd))
-    {
-        return HEAP_ERROR_CORRUPTED_HEAP;
-    }
-    //-----End error checking-------
-
-    if (markBlockUnused(blockStart))
-    {
-        return HEAP_ERROR_CORRUPTED_HEAP;
-    }
-
-    // time to possibly merge with block above
-    // first, make sure there IS a block above us
-    if (blockStart > HEAP_START)
-    {
-        int32_t *previousBlockStart = previousBlockHeader(blockStart);
-        // second, make sure we only merge with an unused block
-        if (blockUnused(previousBlockStart))
+        int32_t cls = cacheClass(*blockStart);
+        int32_t *blockEnd = blockTrailer(blockStart);
+        int32_t index = blockStart - HEAP_START;
+        if (cls >= 0 && *blockStart == HEAP_CACHE_ROOM(cls) && inHeapRange(blockEnd) && *blockEnd == *blockStart &&
+            blockStart[2] == CACHE_TAG)
         {
-            mergeBlockWithBelow(previousBlockStart);
-            blockStart = previousBlockStart; // start of block has moved
+            // cached blocks stay marked used, look for it in every cache unless
+            // the data merely holds the tag
+            sr = StartCritical();
+            int32_t cached = cacheHolds(cls, index);
+            EndCritical(sr);
+            if (cached)
+            {
+                return HEAP_ERROR_CORRUPTED_HEAP; // freed twice
+            }
+        }
+        if (thread >= 0 && cls >= 0 && *blockStart == HEAP_CACHE_ROOM(cls) && inHeapRange(blockEnd) &&
+            *blockEnd == *blockStart && CacheCount[thread][cls] < HEAP_CACHE_DEPTH)
+        {
+            blockStart[1] = CacheHead[thread][cls];
+            blockStart[2] = CACHE_TAG;
+            CacheHead[thread][cls] = index;
+            CacheCount[thread][cls]++;
+#if (HEAP_PROFILE)
+            sr = StartCritical();
+            FreeCycles[profileBucket(OS_TimeDifference(start, OS_Time()))]++;
+            EndCritical(sr);
+#endif
+            return HEAP_OK;
         }
     }
+#endif
+    sr = StartCritical();
+    status = freeBlock(blockStart);
+#if (HEAP_PROFILE)
+    FreeCycles[profileBucket(OS_TimeDifference(start, OS_Time()))]++;
+#endif
+    EndCritical(sr);
+    return status;
+}
 
-    // possibly merge with block below
-    nextBlockStart = nextBlockHeader(blockStart);
-    if (inHeapRange(nextBlockStart) && blockUnused(nextBlockStart))
+//******** Heap_ReleaseCache ***************
+// return the blocks cached by a thread to the heap
+// input: thread id, as returned by OS_Id
+// output: none
+// notes: called by the OS when the thread is killed
+void Heap_ReleaseCache(int32_t thread)
+{
+#if (HEAP_CACHE_DEPTH)
+    int32_t cls;
+    long sr = StartCritical();
+    for (cls = 0; cls < HEAP_CACHE_CLASSES; cls++)
     {
-        mergeBlockWithBelow(blockStart);
+        while (CacheHead[thread][cls] != CACHE_NONE)
+        {
+            int32_t *blockStart = HEAP_START + CacheHead[thread][cls];
+            CacheHead[thread][cls] = blockStart[1];
+            blockStart[2] = 0;
+            freeBlock(blockStart);
+        }
+        CacheCount[thread][cls] = 0;
     }
-    return HEAP_OK;
+    EndCritical(sr);
+#endif
 }
 
 //******** Heap_Test ***************
@@ -252,8 +459,21 @@ int32_t Heap_Free(void *pointer)
 // input: none
 // output: validity of the heap - either HEAP_OK or HEAP_ERROR_HEAP_CORRUPTED
 int32_t Heap_Test(void)
+{
+    long sr = StartCritical();
+    int32_t status = testHeap();
+    EndCritical(sr);
+    return status;
+}
+
+// testHeap
+// input: none
+// output: same as Heap_Test
+// notes: interrupts are assumed to be disabled
+static int32_t testHeap(void)
 {
     int32_t lastBlockWasUnused = 0;
+    int32_t unusedBlocks = 0;
     int32_t *blockStart = HEAP_START;
     while (inHeapRange(blockStart))
     {
@@ -276,6 +496,7 @@ int32_t Heap_Test(void)
             return HEAP_ERROR_CORRUPTED_HEAP;
         }
         lastBlockWasUnused = blockUnused(blockStart);
+        unusedBlocks += lastBlockWasUnused;
         blockStart = blockEnd + 1;
     }
     // traversing the heap should end exactly where the heap ends
@@ -283,6 +504,44 @@ int32_t Heap_Test(void)
     {
         return HEAP_ERROR_CORRUPTED_HEAP;
     }
+#if (HEAP_TLSF)
+    // every unused block should be in the list for its room, and nothing else
+    int32_t fl, sl;
+    for (fl = 0; fl < TLSF_FL_COUNT; fl++)
+    {
+        for (sl = 0; sl < TLSF_SL_COUNT; sl++)
+        {
+            int32_t index = FreeHead[fl][sl];
+            if ((index != TLSF_NONE) != ((FreeSL[fl] >> sl) & 1))
+            {
+                return HEAP_ERROR_CORRUPTED_HEAP;
+            }
+            while (index != TLSF_NONE)
+            {
+                int32_t listFl, listSl;
+                blockStart = HEAP_START + index;
+                if (!inHeapRange(blockStart) || !blockUnused(blockStart) || unusedBlocks-- == 0)
+                {
+                    return HEAP_ERROR_CORRUPTED_HEAP;
+                }
+                tlsfMapping(blockRoom(blockStart), &listFl, &listSl);
+                if (listFl != fl || listSl != sl)
+                {
+                    return HEAP_ERROR_CORRUPTED_HEAP;
+                }
+                index = blockStart[1];
+            }
+        }
+        if ((FreeSL[fl] != 0) != ((FreeFL >> fl) & 1))
+        {
+            return HEAP_ERROR_CORRUPTED_HEAP;
+        }
+    }
+    if (unusedBlocks != 0)
+    {
+        return HEAP_ERROR_CORRUPTED_HEAP;
+    }
+#endif
     return HEAP_OK;
 }
 
@@ -294,13 +553,16 @@ heap_stats_t Heap_Stats(void)
 {
     int32_t *blockStart;
     heap_stats_t stats;
+    long sr;
 
     stats.wordsAllocated = 0;
     stats.wordsAvailable = 0;
     stats.blocksUsed = 0;
     stats.blocksUnused = 0;
+    stats.largestFree = 0;
 
     // just go through each block to get stats on heap usage
+    sr = StartCritical();
     blockStart = HEAP_START;
     while (inHeapRange(blockStart))
     {
@@ -313,13 +575,356 @@ heap_stats_t Heap_Stats(void)
         {
             stats.wordsAvailable += blockRoom(blockStart);
             stats.blocksUnused++;
+            if (blockRoom(blockStart) > stats.largestFree)
+            {
+                stats.largestFree = blockRoom(blockStart);
+            }
         }
         blockStart = nextBlockHeader(blockStart);
     }
+    if (stats.largestFree < LargestFreeLow)
+    {
+        LargestFreeLow = stats.largestFree;
+    }
+    stats.largestFreeLow = LargestFreeLow;
+    EndCritical(sr);
     stats.wordsOverhead = HEAP_SIZE_WORDS - stats.wordsAllocated - stats.wordsAvailable;
+    stats.fragmentation = 0;
+    if (stats.wordsAvailable > 0)
+    {
+        stats.fragmentation = 100 - 100 * stats.largestFree / stats.wordsAvailable;
+    }
     return stats;
 }
 
+//******** Heap_Dump ***************
+// print the heap statistics, the call sites of Heap_Malloc and the
+// Heap_Malloc/Heap_Free latency histograms
+// input: none
+// output: none
+// notes: for the interpreter and the host report, each counter is copied
+//  with interrupts disabled and printed after, so the heap keeps running
+void Heap_Dump(void)
+{
+    heap_stats_t stats = Heap_Stats();
+    printf("heap: %d words in %d used blocks, %d words in %d unused blocks, largest %d (lowest %d), "
+           "fragmentation %d%%\r\n",
+           (int)stats.wordsAllocated, (int)stats.blocksUsed, (int)stats.wordsAvailable, (int)stats.blocksUnused,
+           (int)stats.largestFree, (int)stats.largestFreeLow, (int)stats.fragmentation);
+#if (HEAP_PROFILE)
+    int32_t i, histogram;
+    long sr;
+    for (histogram = 0; histogram < 2; histogram++)
+    {
+        printf(histogram ? "Heap_Free cycles:" : "Heap_Malloc cycles:");
+        for (i = 0; i < HEAP_PROFILE_BUCKETS; i++)
+        {
+            sr = StartCritical();
+            uint32_t count = histogram ? FreeCycles[i] : MallocCycles[i];
+            EndCritical(sr);
+            if (count == 0)
+            {
+                continue;
+            }
+            if (i == HEAP_PROFILE_BUCKETS - 1)
+            {
+                printf(" >=%u:%u", 1u << (i - 1), count);
+            }
+            else
+            {
+                printf(" <%u:%u", 1u << i, count);
+            }
+        }
+        printf("\r\n");
+    }
+    for (i = 0; i < HEAP_PROFILE_SITES; i++)
+    {
+        sr = StartCritical();
+        heap_site_t site = Sites[i];
+        EndCritical(sr);
+        if (site.calls == 0)
+        {
+            continue;
+        }
+        if (i == HEAP_OTHER_SITE)
+        {
+            printf("other sites");
+        }
+        else
+        {
+            printf("site %p", site.site);
+        }
+        printf(": %u calls, %u bytes, max %d, %u failed\r\n", site.calls, site.bytes, (int)site.maxBytes, site.failed);
+    }
+#endif
+}
+
+// allocateBlock
+// input: desired amount of words
+// output: header of the block now marked used, or 0 (NULL) if there isn't one
+//  big enough
+// notes: interrupts are assumed to be disabled
+static int32_t *allocateBlock(int32_t desiredWords)
+{
+    int32_t *blockStart;
+#if (HEAP_TLSF)
+    if (desiredWords < HEAP_MIN_ROOM)
+    {
+        desiredWords = HEAP_MIN_ROOM;
+    }
+    blockStart = tlsfFind(desiredWords); // implements good fit
+    if (blockStart != 0)
+    {
+        if (splitAndMarkBlockUsed(blockStart, desiredWords))
+        {
+            return 0; // NULL
+        }
+        return blockStart;
+    }
+#else
+    blockStart = HEAP_START; // implements first fit
+    while (inHeapRange(blockStart))
+    {
+        // one pass through the heap
+        // choose first block that is big enough
+        if (blockUnused(blockStart) && desiredWords <= blockRoom(blockStart))
+        {
+            if (splitAndMarkBlockUsed(blockStart, desiredWords))
+            {
+                return 0; // NULL
+            }
+            return blockStart;
+        }
+        blockStart = nextBlockHeader(blockStart);
+    }
+#endif
+    return 0; // NULL
+}
+
+// freeBlock
+// input: header of a block to unallocate
+// output: same as Heap_Free
+// notes: interrupts are assumed to be disabled
+static int32_t freeBlock(int32_t *blockStart)
+{
+    int32_t *blockEnd;
+    int32_t *nextBlockStart;
+
+    //-----Begin error checking-------
+    if (!inHeapRange(blockStart))
+    {
+        return HEAP_ERROR_POINTER_OUT_OF_RANGE;
+    }
+    if (blockUnused(blockStart))
+    {
+        return HEAP_ERROR_CORRUPTED_HEAP;
+    }
+    blockEnd = blockTrailer(blockStart);
+    if (!inHeapRange(blockEnd) || blockUnused(blockEnd))
+    {
+        return HEAP_ERROR_CORRUPTED_HEAP;
+    }
+    //-----End error checking-------
+
+    if (markBlockUnused(blockStart))
+    {
+        return HEAP_ERROR_CORRUPTED_HEAP;
+    }
+
+    // time to possibly merge with block above
+    // first, make sure there IS a block above us
+    if (blockStart > HEAP_START)
+    {
+        int32_t *previousBlockStart = previousBlockHeader(blockStart);
+        // second, make sure we only merge with an unused block
+        if (blockUnused(previousBlockStart))
+        {
+#if (HEAP_TLSF)
+            tlsfRemove(previousBlockStart);
+#endif
+            mergeBlockWithBelow(previousBlockStart);
+            blockStart = previousBlockStart; // start of block has moved
+        }
+    }
+
+    // possibly merge with block below
+    nextBlockStart = nextBlockHeader(blockStart);
+    if (inHeapRange(nextBlockStart) && blockUnused(nextBlockStart))
+    {
+#if (HEAP_TLSF)
+        tlsfRemove(nextBlockStart);
+#endif
+        mergeBlockWithBelow(blockStart);
+    }
+#if (HEAP_TLSF)
+    tlsfInsert(blockStart);
+#endif
+    return HEAP_OK;
+}
+
+#if (HEAP_PROFILE)
+// profileBucket
+// input: cycles taken by a call
+// output: histogram bucket of the call
+static int32_t profileBucket(uint32_t cycles)
+{
+    int32_t bucket = 0;
+    while (cycles != 0 && bucket < HEAP_PROFILE_BUCKETS - 1)
+    {
+        cycles >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// profileMalloc
+// input: return address of the call, bytes asked for, header of the block
+//  returned or 0 (NULL), OS_Time at the start of the call
+// output: none
+// notes: interrupts are assumed to be disabled. A site is looked up from
+//  the entry its address hashes to, taking the first free entry, so each
+//  site keeps its entry until Heap_Init
+static void profileMalloc(void *site, int32_t desiredBytes, void *block, uint32_t start)
+{
+    int32_t i = ((uintptr_t)site >> 1) % HEAP_OTHER_SITE;
+    int32_t probes;
+    MallocCycles[profileBucket(OS_TimeDifference(start, OS_Time()))]++;
+    for (probes = 0; probes < HEAP_OTHER_SITE; probes++)
+    {
+        if (Sites[i].site == site || Sites[i].site == 0)
+        {
+            break;
+        }
+        i = (i + 1) % HEAP_OTHER_SITE;
+    }
+    if (probes == HEAP_OTHER_SITE)
+    {
+        i = HEAP_OTHER_SITE;
+    }
+    else
+    {
+        Sites[i].site = site;
+    }
+    Sites[i].calls++;
+    Sites[i].bytes += desiredBytes;
+    Sites[i].failed += (block == 0);
+    if (desiredBytes > Sites[i].maxBytes)
+    {
+        Sites[i].maxBytes = desiredBytes;
+    }
+}
+#endif
+
+#if (HEAP_REALLOC_IN_PLACE)
+// reallocInPlace
+// input: header of a used block, desired number of bytes, return address of
+//  the Heap_Realloc call
+// output: pointer to the resized block, same as before, or 0 (NULL) if it
+//  has to move
+// notes: interrupts are assumed to be disabled. The block takes in the
+//  unused block after it, if any, then gives back what it does not need,
+//  so growing and shrinking both take constant time.
+static int32_t *reallocInPlace(int32_t *blockStart, int32_t desiredBytes, void *site)
+{
+#if (HEAP_PROFILE)
+    uint32_t start = OS_Time();
+#endif
+    int32_t desiredWords = (desiredBytes + sizeof(int32_t) - 1) / sizeof(int32_t);
+    int32_t *blockEnd = blockTrailer(blockStart);
+    int32_t *nextBlockStart;
+    int32_t room;
+    if (desiredWords <= 0 || !inHeapRange(blockEnd) || *blockEnd != *blockStart)
+    {
+        return 0; // NULL
+    }
+#if (HEAP_CACHE_DEPTH)
+    int32_t cls = cacheClass(desiredWords);
+    if (cls >= 0)
+    {
+        desiredWords = HEAP_CACHE_ROOM(cls); // same rounding as Heap_Malloc
+    }
+#endif
+    if (desiredWords < HEAP_MIN_ROOM)
+    {
+        desiredWords = HEAP_MIN_ROOM;
+    }
+    room = blockRoom(blockStart);
+    nextBlockStart = blockEnd + 1;
+    if (inHeapRange(nextBlockStart) && blockUnused(nextBlockStart))
+    {
+        room += blockRoom(nextBlockStart) + 2;
+    }
+    else
+    {
+        nextBlockStart = 0;
+    }
+    if (room < desiredWords)
+    {
+        return 0; // NULL must move
+    }
+    // unless there is nothing to take in or give back
+    if (nextBlockStart != 0 || blockRoom(blockStart) - desiredWords - 2 >= HEAP_MIN_ROOM)
+    {
+        markBlockUnused(blockStart);
+        if (nextBlockStart != 0)
+        {
+#if (HEAP_TLSF)
+            tlsfRemove(nextBlockStart);
+#endif
+            mergeBlockWithBelow(blockStart);
+        }
+        splitAndMarkBlockUsed(blockStart, desiredWords);
+    }
+#if (HEAP_PROFILE)
+#if (HEAP_TLSF)
+    trackLargestFree();
+#endif
+    profileMalloc(site, desiredBytes, blockStart, start);
+#endif
+    return blockStart + 1;
+}
+#endif
+
+#if (HEAP_CACHE_DEPTH)
+// cacheClass
+// input: room of a block
+// output: smallest cache class whose blocks have that much room, -1 if none
+static int32_t cacheClass(int32_t room)
+{
+    int32_t cls = 0;
+    while (HEAP_CACHE_ROOM(cls) < room)
+    {
+        if (++cls == HEAP_CACHE_CLASSES)
+        {
+            return -1;
+        }
+    }
+    return cls;
+}
+
+// cacheHolds
+// input: cache class, offset of a block header from HEAP_START
+// output: whether the block is in the cache of that class of any thread
+// notes: interrupts must be disabled
+static int32_t cacheHolds(int32_t cls, int32_t index)
+{
+    int32_t thread;
+    for (thread = 0; thread < MAX_THREADS; thread++)
+    {
+        int32_t cached = CacheHead[thread][cls];
+        while (cached != CACHE_NONE)
+        {
+            if (cached == index)
+            {
+                return 1;
+            }
+            cached = HEAP_START[cached + 1];
+        }
+    }
+    return 0;
+}
+#endif
+
 // inHeapRange
 // input: a pointer
 // output: whether or not the pointer points inside the heap
@@ -444,12 +1049,13 @@ static int32_t markBlockUnused(int32_t *blockStart)
 // notes: splits the block given so that the new upper block holds desiredRoom
 //  words (or more).  Marks the upper block as used, lower block as unused.
 //  Will not split a block if the leftover room is insufficient to make another
-//  useful block.
+//  useful block. With HEAP_TLSF the block must already be out of its list,
+//  the lower block goes into the list for its room.
 static int32_t splitAndMarkBlockUsed(int32_t *upperBlockStart, int32_t desiredRoom)
 {
     int32_t leftoverRoom = blockRoom(upperBlockStart) - desiredRoom - 2;
     // only split block if leftovers could actually make another useful block
-    if (leftoverRoom > 0)
+    if (leftoverRoom >= HEAP_MIN_ROOM)
     {
         int32_t *upperBlockEnd = upperBlockStart + desiredRoom + 1;
         int32_t *lowerBlockStart = upperBlockEnd + 1;
@@ -458,6 +1064,9 @@ static int32_t splitAndMarkBlockUsed(int32_t *upperBlockStart, int32_t desiredRo
         *upperBlockEnd = desiredRoom;
         *lowerBlockStart = -leftoverRoom; // marked unused
         *lowerBlockEnd = -leftoverRoom;
+#if (HEAP_TLSF)
+        tlsfInsert(lowerBlockStart);
+#endif
     }
     // can't split block - just mark it at used
     else
@@ -486,3 +1095,157 @@ static void mergeBlockWithBelow(int32_t *upperBlockStart)
     *lowerBlockEnd = -room;
     return;
 }
+
+#if (HEAP_TLSF)
+// tlsfMapping
+// input: room of a block, where to put its list
+// output: none
+// notes: rooms below TLSF_SL_COUNT get a list each in fl 0, above that
+//  each power of two is split into TLSF_SL_COUNT lists
+static void tlsfMapping(int32_t room, int32_t *fl, int32_t *sl)
+{
+    if (room < TLSF_SL_COUNT)
+    {
+        *fl = 0;
+        *sl = room;
+    }
+    else
+    {
+        int32_t topBit = tlsfFls(room);
+        *fl = topBit - TLSF_SL_LOG2 + 1;
+        *sl = (room >> (topBit - TLSF_SL_LOG2)) - TLSF_SL_COUNT;
+    }
+}
+
+// tlsfInsert
+// input: pointer to the header of an unused block
+// output: none
+// notes: puts the block at the head of the list for its room
+static void tlsfInsert(int32_t *blockStart)
+{
+    int32_t fl, sl;
+    int32_t index = blockStart - HEAP_START;
+    tlsfMapping(blockRoom(blockStart), &fl, &sl);
+    int32_t next = FreeHead[fl][sl];
+    blockStart[1] = next;
+    blockStart[2] = TLSF_NONE;
+    if (next != TLSF_NONE)
+    {
+        HEAP_START[next + 2] = index;
+    }
+    FreeHead[fl][sl] = index;
+    FreeSL[fl] |= 1u << sl;
+    FreeFL |= 1u << fl;
+}
+
+// tlsfRemove
+// input: pointer to the header of an unused block
+// output: none
+// notes: takes the block out of the list for its room
+static void tlsfRemove(int32_t *blockStart)
+{
+    int32_t fl, sl;
+    int32_t next = blockStart[1];
+    int32_t previous = blockStart[2];
+    tlsfMapping(blockRoom(blockStart), &fl, &sl);
+    if (next != TLSF_NONE)
+    {
+        HEAP_START[next + 2] = previous;
+    }
+    if (previous != TLSF_NONE)
+    {
+        HEAP_START[previous + 1] = next;
+        return;
+    }
+    FreeHead[fl][sl] = next;
+    if (next == TLSF_NONE)
+    {
+        FreeSL[fl] &= ~(1u << sl);
+        if (FreeSL[fl] == 0)
+        {
+            FreeFL &= ~(1u << fl);
+        }
+    }
+}
+
+// tlsfFind
+// input: desired amount of words
+// output: header of an unused block with at least desiredRoom words, taken
+//  out of its list, or 0 (NULL) if there is none
+// notes: looks in the first list whose blocks all fit, so at worst a block
+//  1/TLSF_SL_COUNT bigger than needed is split when a smaller one was free
+static int32_t *tlsfFind(int32_t desiredRoom)
+{
+    int32_t fl, sl;
+    uint32_t map;
+    int32_t *blockStart;
+    if (desiredRoom >= TLSF_SL_COUNT)
+    {
+        // round up to the next list, blocks in the list of desiredRoom may be smaller
+        desiredRoom += (1 << (tlsfFls(desiredRoom) - TLSF_SL_LOG2)) - 1;
+    }
+    tlsfMapping(desiredRoom, &fl, &sl);
+    if (fl >= TLSF_FL_COUNT)
+    {
+        return 0; // NULL
+    }
+    map = FreeSL[fl] & (~0u << sl);
+    if (map == 0)
+    {
+        // any list of a bigger power of two
+        map = FreeFL & (~0u << (fl + 1));
+        if (map == 0)
+        {
+            return 0; // NULL
+        }
+        fl = tlsfFfs(map);
+        map = FreeSL[fl];
+    }
+    sl = tlsfFfs(map);
+    blockStart = HEAP_START + FreeHead[fl][sl];
+    tlsfRemove(blockStart);
+    return blockStart;
+}
+
+#if (HEAP_PROFILE)
+// tlsfLargest
+// input: none
+// output: room of the largest unused block, 0 if there is none
+// notes: the block is in the highest list that is not empty, whose blocks
+//  differ by less than 1/TLSF_SL_COUNT
+static int32_t tlsfLargest(void)
+{
+    int32_t fl, sl, index;
+    int32_t largest = 0;
+    if (FreeFL == 0)
+    {
+        return 0;
+    }
+    fl = tlsfFls(FreeFL);
+    sl = tlsfFls(FreeSL[fl]);
+    for (index = FreeHead[fl][sl]; index != TLSF_NONE; index = HEAP_START[index + 1])
+    {
+        if (blockRoom(HEAP_START + index) > largest)
+        {
+            largest = blockRoom(HEAP_START + index);
+        }
+    }
+    return largest;
+}
+
+// trackLargestFree
+// input: none
+// output: none
+// notes: interrupts are assumed to be disabled, lowers LargestFreeLow after
+//  a block was taken, only the top list has to be walked. Without TLSF
+//  Heap_Stats finds the largest block.
+static void trackLargestFree(void)
+{
+    int32_t largest = tlsfLargest();
+    if (largest < LargestFreeLow)
+    {
+        LargestFreeLow = largest;
+    }
+}
+#endif
+#endif
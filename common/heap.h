@@ -30,9 +30,43 @@
 
 // feel free to change HEAP_SIZE_BYTES to however
 // big you want the heap to be
+#ifndef HEAP_SIZE_BYTES
 #define HEAP_SIZE_BYTES (8192)
+#endif
 #define HEAP_SIZE_WORDS (HEAP_SIZE_BYTES / sizeof(int32_t))
 
+// 1 keeps free blocks in two-level segregated fit (TLSF) lists so Heap_Malloc
+// and Heap_Free take constant time, 0 scans the heap first fit on every
+// Heap_Malloc. Both keep the same blocks, so Heap_Test and Heap_Stats agree.
+#ifndef HEAP_TLSF
+#define HEAP_TLSF 1
+#endif
+
+// Freed blocks of 2, 4, 8 and 16 words each thread keeps for itself, 0
+// disables the caches. Heap_Malloc and Heap_Free take them without disabling
+// interrupts, only the owner thread touches its cache. A cached block still
+// counts as allocated in Heap_Stats.
+#ifndef HEAP_CACHE_DEPTH
+#define HEAP_CACHE_DEPTH 2
+#endif
+#define HEAP_CACHE_CLASSES 4
+
+// 1 lets Heap_Realloc shrink a block by splitting it and grow it by taking
+// in the unused block after it, 0 always moves the data to a new block
+#ifndef HEAP_REALLOC_IN_PLACE
+#define HEAP_REALLOC_IN_PLACE 1
+#endif
+
+// 1 counts the calls, words and failures of each place Heap_Malloc is called
+// from and keeps a histogram of Heap_Malloc and Heap_Free cycles, see
+// Heap_Dump. Costs two OS_Time reads and a short critical section per call,
+// even on the per-thread cache fast paths, so it is off unless asked for.
+#ifndef HEAP_PROFILE
+#define HEAP_PROFILE 0
+#endif
+#define HEAP_PROFILE_SITES 16   // call sites told apart, the rest are counted together
+#define HEAP_PROFILE_BUCKETS 12 // bucket b counts calls taking 2^(b-1) to 2^b - 1 cycles
+
 #define HEAP_OK 0
 #define HEAP_ERROR_CORRUPTED_HEAP 1
 #define HEAP_ERROR_POINTER_OUT_OF_RANGE 2
@@ -45,8 +79,14 @@ typedef struct heap_stats
     int32_t wordsOverhead;
     int32_t blocksUsed;
     int32_t blocksUnused;
+    int32_t largestFree;    // room of the largest unused block, the biggest Heap_Malloc that succeeds
+    int32_t largestFreeLow; // smallest largestFree seen since Heap_Init
+    int32_t fragmentation;  // percent of wordsAvailable outside the largest unused block
 } heap_stats_t;
 
+// All of the functions below may be called from threads and interrupt
+// handlers alike, they disable interrupts while they change the heap.
+
 //******** Heap_Init ***************
 // Initialize the Heap
 // input: none
@@ -80,8 +120,10 @@ void *Heap_Calloc(int32_t desiredBytes);
 //    where the contents of the old block will be copied to
 // output: void* pointing to the new block or will return NULL
 //   if there is any reason the reallocation can't be completed
-// notes: the given block will be unallocated after its contents
-//   are copied to the new block
+// notes: the block is resized where it is if it shrinks or the block after
+//   it is unused and big enough, otherwise the contents are copied to a new
+//   block and the given block is unallocated. The given block is left
+//   as it was when NULL is returned.
 void *Heap_Realloc(void *oldBlock, int32_t desiredBytes);
 
 //******** Heap_Free ***************
@@ -93,6 +135,13 @@ void *Heap_Realloc(void *oldBlock, int32_t desiredBytes);
 //  unallocate memory that has already been unallocated;
 int32_t Heap_Free(void *pointer);
 
+//******** Heap_ReleaseCache ***************
+// return the blocks cached by a thread to the heap
+// input: thread id, as returned by OS_Id
+// output: none
+// notes: called by the OS when the thread is killed
+void Heap_ReleaseCache(int32_t thread);
+
 //******** Heap_Test ***************
 // Test the heap
 // input: none
@@ -105,4 +154,13 @@ int32_t Heap_Test(void);
 // output: a heap_stats_t that describes the current usage of the heap
 heap_stats_t Heap_Stats(void);
 
+//******** Heap_Dump ***************
+// print the heap statistics, the call sites of Heap_Malloc and the
+// Heap_Malloc/Heap_Free latency histograms
+// input: none
+// output: none
+// notes: for the interpreter and the host report, each counter is copied
+//  with interrupts disabled and printed after, so the heap keeps running
+void Heap_Dump(void);
+
 #endif // #ifndef HEAP_H
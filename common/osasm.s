@@ -33,6 +33,7 @@ StartOS
     LDR R1, [R0] ; R1 = value of RunPt
     LDR SP, [R1] ; new thread SP; SP = RunPt->sp;
     POP {R4-R11} ; restore regs r4-11
+    ADD SP, SP, #4 ; discard EXC_RETURN, the thread has not used the FPU yet
     POP {R0-R3} ; restore regs r0-3
     POP {R12}
     ADD SP, SP, #4 ; discard LR from initial stack
@@ -91,7 +92,13 @@ ContextSwitch
 ;              d) OSTCBCur      points to the OS_TCB of the task to suspend
 ;                 OSTCBHighRdy  points to the OS_TCB of the task to resume
 ;
-;           4) Since PendSV is set to lowest priority in the system (by OSStartHighRdy() above), we
+;           4) Lazy FPU context save: a thread that used the FPU is interrupted with an extended frame,
+;              bit 4 of EXC_RETURN in LR is then clear. Only those threads save S16-S31, the processor
+;              stacks S0-S15 and FPSCR itself when VPUSH is the first FPU instruction of the handler.
+;              EXC_RETURN is saved with R4-R11, so each thread returns with its own frame type.
+;              Assembled for a soft float target, no thread can use the FPU and this is left out.
+;
+;           5) Since PendSV is set to lowest priority in the system (by OSStartHighRdy() above), we
 ;              know that it will only be run when no other exception or interrupt is active, and
 ;              therefore safe to assume that context being switched out was using the process stack (PSP).
 ;********************************************************************************************************
@@ -99,7 +106,12 @@ ContextSwitch
 PendSV_Handler
 ; put your code here
     CPSID   I
-    PUSH    {R4-R11}
+    IF {TARGET_FPU_VFP}
+    TST     LR, #0x10       ; EXC_RETURN bit 4 clear: extended frame, the thread used the FPU
+    IT      EQ
+    VPUSHEQ {S16-S31}
+    ENDIF
+    PUSH    {R4-R11, LR}
     LDR     R0, =RunPt
     LDR     R1, [R0]
     STR     SP, [R1]        ; save sp into RunPt->sp
@@ -109,7 +121,12 @@ PendSV_Handler
     STR     R1, [R0]        ; set RunPt = NextPt
 
     LDR     SP, [R1]        ; load sp back from new RunPt
-    POP     {R4-R11}
+    POP     {R4-R11, LR}    ; LR = EXC_RETURN of the new thread
+    IF {TARGET_FPU_VFP}
+    TST     LR, #0x10
+    IT      EQ
+    VPOPEQ  {S16-S31}
+    ENDIF
     CPSIE   I
     BX      LR                 ; Exception return will restore remaining context
 
@@ -6,72 +6,264 @@
 #include "../common/OS.h"
 #include "../common/heap.h"
 
-#define BANKERS_DEBUG 1
+// 1 prints every request and release, slow enough over UART0 to hold the
+// lock for milliseconds, the trace ring (BANKERS_TRACE) is the cheap option
+#ifndef BANKERS_DEBUG
+#define BANKERS_DEBUG 0
+#endif
+// 1 re-verifies only the customers ahead of the requester in the last safe
+// sequence, 0 reruns the full safety algorithm on every request
+#ifndef BANKERS_INCREMENTAL
+#define BANKERS_INCREMENTAL 1
+#endif
+#if (OS_HOSTED)
+static volatile uint32_t PD1;  // no logic analyzer pins on the host
+#else
 #define PD1 (*((volatile uint32_t *)0x40007008))
+#endif
 
-uint32_t size_resources = -1;
-uint32_t size_customers = -1;
+// Resource vectors, see BANKERS_LANE_BITS
+typedef BankersVec vec_t;
+#if (BANKERS_LANE_BITS)
+#define LANES (8 * sizeof(vec_t) / BANKERS_LANE_BITS)
+#define LANE_MASK ((1ul << BANKERS_LANE_BITS) - 1)
+#define LANE_GUARD ((vec_t)-1 / LANE_MASK << (BANKERS_LANE_BITS - 1))  // top bit of every lane
+#else
+#define LANES 1
+#endif
+// Every vector and matrix row starts on this boundary so it can be loaded
+// a full vector register at a time
+#define BANKERS_ALIGN 16
+
+#define ROW(ctx, matrix, customer) ((ctx)->matrix + (customer) * (ctx)->size_stride)
+
+BankersCtx BankersDefault;
+
+// Adds count[0..size_resources-1] to v
+// Returns BANKERS_INVALID if a count is negative or a total goes above BANKERS_MAX_UNITS
+static int vec_pack_add(BankersCtx *ctx, vec_t *v, const int *count) {
+    for (int i = 0; i < ctx->size_resources; i++) {
+#if (BANKERS_LANE_BITS)
+        int shift = i % LANES * BANKERS_LANE_BITS;
+        int total = (v[i / LANES] >> shift) & LANE_MASK;
+        if (count[i] < 0 || count[i] > BANKERS_MAX_UNITS - total) {
+            return BANKERS_INVALID;
+        }
+        v[i / LANES] += (vec_t)count[i] << shift;
+#else
+        if (count[i] < 0 || count[i] > BANKERS_MAX_UNITS - v[i]) {
+            return BANKERS_INVALID;
+        }
+        v[i] += count[i];
+#endif
+    }
+    return BANKERS_OK;
+}
 
-Sema4Type bankers_lock;
-Sema4Type blocked;
-int *available;
+// Packs count[0..size_resources-1] into v
+// Returns BANKERS_INVALID if a count is negative or above BANKERS_MAX_UNITS
+static int vec_pack(BankersCtx *ctx, vec_t *v, const int *count) {
+    memset(v, 0, sizeof(vec_t) * ctx->size_words);
+    return vec_pack_add(ctx, v, count);
+}
 
-struct Customer {
-    int *maximum;
-    int *allocation;
-    int *need;
-    int8_t initialized;
-};
-typedef struct Customer Customer;
+// Packs the sum of count[0..num-1] into v
+// Returns BANKERS_INVALID if a count is negative or a total goes above BANKERS_MAX_UNITS
+static int vec_pack_sum(BankersCtx *ctx, vec_t *v, int **count, int num) {
+    memset(v, 0, sizeof(vec_t) * ctx->size_words);
+    for (int n = 0; n < num; n++) {
+        if (count[n] == NULL || vec_pack_add(ctx, v, count[n]) != BANKERS_OK) {
+            return BANKERS_INVALID;
+        }
+    }
+    return BANKERS_OK;
+}
 
-Customer *customers;
-int8_t *finished;
+#if (BANKERS_DEBUG)
+// Returns the count of resource i in v
+static int vec_get(const vec_t *v, int i) {
+#if (BANKERS_LANE_BITS)
+    return (v[i / LANES] >> (i % LANES * BANKERS_LANE_BITS)) & LANE_MASK;
+#else
+    return v[i];
+#endif
+}
+#endif
 
-int Bankers_Init(int num_resources, int num_threads, int *available_init) {
-    if (num_resources < 0 || available_init == NULL) {
+// Returns 1 if a[i] <= b[i] for every resource, 0 otherwise
+static int vec_fits(BankersCtx *ctx, const vec_t *a, const vec_t *b) {
+#if (BANKERS_LANE_BITS)
+    // b | guard is at least 2^(bits-1) in every lane and a is below that, so
+    // the subtraction never borrows across lanes, and a lane keeps its guard
+    // bit exactly when a <= b. No early exit, so gcc -O3 vectorizes the loop.
+    vec_t borrow = 0;
+    for (int w = 0; w < ctx->size_words; w++) {
+        borrow |= ~((b[w] | LANE_GUARD) - a[w]);
+    }
+    return (borrow & LANE_GUARD) == 0;
+#else
+    for (int i = 0; i < ctx->size_resources; i++) {
+        if (a[i] > b[i]) {
+            return 0;
+        }
+    }
+    return 1;
+#endif
+}
+
+// a += b, no lane can carry since no count exceeds the units of its resource
+static void vec_add(BankersCtx *ctx, vec_t *a, const vec_t *b) {
+    for (int w = 0; w < ctx->size_words; w++) {
+        a[w] += b[w];
+    }
+}
+
+// a -= b, b must fit in a
+static void vec_sub(BankersCtx *ctx, vec_t *a, const vec_t *b) {
+    for (int w = 0; w < ctx->size_words; w++) {
+        a[w] -= b[w];
+    }
+}
+
+#if (BANKERS_TRACE)
+// Folds the packed vector v into a 32-bit hash, to tell requests apart in the trace
+static uint32_t vec_hash(BankersCtx *ctx, const vec_t *v) {
+    uint32_t hash = 2166136261u;  // FNV-1a over whole words
+    for (int i = 0; i < ctx->size_words; i++) {
+        vec_t w = v[i] ^ (v[i] >> 16 >> 16);  // upper half of 64-bit words
+        hash = (hash ^ (uint32_t)w) * 16777619u;
+    }
+    return hash;
+}
+
+// Records an event about vector v in the trace ring, for an operation that
+// started at OS_Time start. The lock of ctx is assumed to be held.
+#define Bankers_TraceStart(start) uint32_t start = OS_Time()
+static void Bankers_Trace(BankersCtx *ctx, uint32_t start, int customer, int kind, const vec_t *v, int status) {
+    BankersEvent *event = &ctx->trace[ctx->trace_count % BANKERS_TRACE];
+    event->cycles = OS_TimeDifference(start, OS_Time());
+    event->hash = vec_hash(ctx, v);
+    event->customer = customer;
+    event->kind = kind;
+    event->status = status;
+    ctx->trace_count++;
+}
+#else
+#define Bankers_TraceStart(start)
+#define Bankers_Trace(ctx, start, customer, kind, v, status)
+#endif
+
+// Returns nonzero if any count in v is nonzero
+static vec_t vec_any(BankersCtx *ctx, const vec_t *v) {
+    vec_t any = 0;
+    for (int w = 0; w < ctx->size_words; w++) {
+        any |= v[w];
+    }
+    return any;
+}
+
+int Bankers_ArenaSize(int num_resources, int num_threads) {
+    if (num_resources < 0) {
+        return 0;
+    }
+
+    if (num_threads < 0) {
+        num_threads = BANKERS_CUSTOMERS;
+    }
+
+    int words = (num_resources + LANES - 1) / LANES;
+    int stride = (words * sizeof(vec_t) + BANKERS_ALIGN - 1) / BANKERS_ALIGN * BANKERS_ALIGN;
+    int size = BANKERS_ALIGN - 1                     // aligning the arena itself
+               + stride * (2 * num_threads + 3)      // allocation, need, available, scratch, work
+               + sizeof(int) * 3 * num_threads       // safe_order, safe_position, next_order
+               + sizeof(int8_t) * 2 * num_threads;   // initialized, finished
+#if (BANKERS_TARGETED_WAKEUP)
+    size += stride * num_threads                     // pending
+            + sizeof(Sema4Type) * num_threads        // wake
+            + sizeof(int) * 3 * num_threads;         // pending_next, thread, priority
+#endif
+    return size;
+}
+
+int BankersCtx_InitArena(BankersCtx *ctx, int num_resources, int num_threads, int *available_init, void *arena, int size) {
+    if (num_resources < 0 || available_init == NULL || arena == NULL) {
         return BANKERS_INVALID;
     }
 
     if (num_threads < 0) {
-        num_threads = MAX_THREADS;
+        num_threads = BANKERS_CUSTOMERS;
     }
 
-    available = Heap_Calloc(sizeof(int) * num_resources);
-    if (available == NULL)
+    if (size < Bankers_ArenaSize(num_resources, num_threads)) {
         return BANKERS_MALLOC_ERR;
+    }
 
-    customers = Heap_Calloc(sizeof(Customer) * num_threads);
-    if (customers == NULL)
-        return BANKERS_MALLOC_ERR;
-    for (int i = 0; i < num_threads; i++) {
-        customers[i].maximum = Heap_Calloc(sizeof(int) * num_resources);
-        if (customers[i].maximum == NULL)
-            return BANKERS_MALLOC_ERR;
-        customers[i].allocation = Heap_Calloc(sizeof(int) * num_resources);
-        if (customers[i].allocation == NULL)
-            return BANKERS_MALLOC_ERR;
-        customers[i].need = Heap_Calloc(sizeof(int) * num_resources);
-        if (customers[i].need == NULL)
-            return BANKERS_MALLOC_ERR;
-    }
-    finished = Heap_Calloc(sizeof(int8_t) * num_threads);
-
-    if (available_init != NULL) {
-        for (int i = 0; i < num_resources; i++) {
-            available[i] = available_init[i];
+    // ctx is left alone unless every count can be packed
+    for (int i = 0; i < num_resources; i++) {
+        if (available_init[i] < 0 || available_init[i] > BANKERS_MAX_UNITS) {
+            return BANKERS_INVALID;
         }
     }
 
-    OS_InitSemaphore(&bankers_lock, 1);
-    OS_InitSemaphore(&blocked, 0);
-    size_resources = num_resources;
-    size_customers = num_threads;
+    ctx->size_resources = num_resources;
+    ctx->size_customers = num_threads;
+    ctx->size_words = (num_resources + LANES - 1) / LANES;
+    ctx->size_stride = (ctx->size_words * sizeof(vec_t) + BANKERS_ALIGN - 1) / BANKERS_ALIGN * BANKERS_ALIGN / sizeof(vec_t);
+
+    memset(arena, 0, size);
+    uint8_t *next = (uint8_t *)(((uintptr_t)arena + BANKERS_ALIGN - 1) & ~(uintptr_t)(BANKERS_ALIGN - 1));
+    ctx->allocation = (vec_t *)next;
+    next += sizeof(vec_t) * ctx->size_stride * num_threads;
+    ctx->need = (vec_t *)next;
+    next += sizeof(vec_t) * ctx->size_stride * num_threads;
+    ctx->available = (vec_t *)next;
+    next += sizeof(vec_t) * ctx->size_stride;
+    ctx->scratch = (vec_t *)next;
+    next += sizeof(vec_t) * ctx->size_stride;
+    ctx->work = (vec_t *)next;
+    next += sizeof(vec_t) * ctx->size_stride;
+#if (BANKERS_TARGETED_WAKEUP)
+    ctx->pending = (vec_t *)next;
+    next += sizeof(vec_t) * ctx->size_stride * num_threads;
+    ctx->wake = (Sema4Type *)next;
+    next += sizeof(Sema4Type) * num_threads;
+    ctx->pending_next = (int *)next;
+    next += sizeof(int) * num_threads;
+    ctx->thread = (uint32_t *)next;
+    next += sizeof(uint32_t) * num_threads;
+    ctx->priority = (uint32_t *)next;
+    next += sizeof(uint32_t) * num_threads;
+#endif
+    ctx->safe_order = (int *)next;
+    next += sizeof(int) * num_threads;
+    ctx->safe_position = (int *)next;
+    next += sizeof(int) * num_threads;
+    ctx->next_order = (int *)next;
+    next += sizeof(int) * num_threads;
+    ctx->initialized = (int8_t *)next;
+    next += sizeof(int8_t) * num_threads;
+    ctx->finished = (int8_t *)next;
+
+    vec_pack(ctx, ctx->available, available_init);
+    ctx->safe_valid = 0;
+    ctx->full_checks = ctx->prefix_checks = ctx->requests = ctx->releases = 0;
+#if (BANKERS_TRACE)
+    ctx->trace_count = 0;
+#endif
+
+    OS_InitSemaphore(&ctx->lock, 1);
+#if (BANKERS_TARGETED_WAKEUP)
+    ctx->pending_head = -1;
+    ctx->wakeups = 0;
+#else
+    OS_InitSemaphore(&ctx->blocked, 0);
+#endif
 
 #if (BANKERS_DEBUG)
     printf("Initial state of the system:\r\n");
     printf("Available resources: ");
     for (int i = 0; i < num_resources; i++) {
-        printf("%d ", available[i]);
+        printf("%d ", vec_get(ctx->available, i));
     }
     printf("\r\n");
 #endif
@@ -79,69 +271,78 @@ int Bankers_Init(int num_resources, int num_threads, int *available_init) {
     return BANKERS_OK;
 }
 
-int Bankers_SetMaxDemand(int customer, int *max_demand) {
+int BankersCtx_Init(BankersCtx *ctx, int num_resources, int num_threads, int *available_init) {
+    if (num_resources < 0 || available_init == NULL) {
+        return BANKERS_INVALID;
+    }
+
+    int size = Bankers_ArenaSize(num_resources, num_threads);
+    void *arena = Heap_Malloc(size);
+    if (arena == NULL)
+        return BANKERS_MALLOC_ERR;
+
+    int status = BankersCtx_InitArena(ctx, num_resources, num_threads, available_init, arena, size);
+    if (status != BANKERS_OK)
+        Heap_Free(arena);
+    return status;
+}
+
+int BankersCtx_SetMaxDemand(BankersCtx *ctx, int customer, int *max_demand) {
     if (customer < 0) {
         customer = OS_Id();
     }
 
-    if (customer >= size_customers) {
+    if (customer >= ctx->size_customers) {
         return BANKERS_INVALID;
     }
 
-    for (int i = 0; i < size_resources; i++) {
-        if (max_demand[i] < 0) {
-            return BANKERS_INVALID;
-        }
+    if (max_demand == NULL) {
+        return BANKERS_INVALID;
     }
 
-    OS_bWait(&bankers_lock);
-    for (int i = 0; i < size_resources; i++) {
-        customers[customer].maximum[i] = max_demand[i];
-        customers[customer].need[i] = max_demand[i] - customers[customer].allocation[i];
+    OS_bWait(&ctx->lock);
+    // the maximum can not drop below what the customer already holds
+    if (vec_pack(ctx, ctx->scratch, max_demand) != BANKERS_OK || !vec_fits(ctx, ROW(ctx, allocation, customer), ctx->scratch)) {
+        OS_bSignal(&ctx->lock);
+        return BANKERS_INVALID;
     }
-    customers[customer].initialized = 1;
-    OS_bSignal(&bankers_lock);
+    memcpy(ROW(ctx, need, customer), ctx->scratch, sizeof(vec_t) * ctx->size_words);
+    vec_sub(ctx, ROW(ctx, need, customer), ROW(ctx, allocation, customer));
+    ctx->initialized[customer] = 1;
+    ctx->safe_valid = 0;  // need may have grown, the cached sequence proves nothing
+    OS_bSignal(&ctx->lock);
 
     return BANKERS_OK;
 }
 
 // Helper function to check if there exists a safe exit sequence of the processes.
-// bankers_lock is assumed to be held before calling this function.
-int Bankers_CheckSafeSequence() {
+// On success the sequence found becomes the cached safe sequence.
+// The lock of ctx is assumed to be held before calling this function.
+static int Bankers_CheckSafeSequence(BankersCtx *ctx) {
     PD1 ^= 0x02;
     int done = 0;
-    int *curr_available = Heap_Malloc(sizeof(int) * size_resources);
-    if (available == NULL)
-        return BANKERS_MALLOC_ERR;
-    memcpy(curr_available, available, sizeof(int) * size_resources);
-    memset(finished, 0, sizeof(int8_t) * size_customers);
+    memcpy(ctx->work, ctx->available, sizeof(vec_t) * ctx->size_words);
+    memset(ctx->finished, 0, sizeof(int8_t) * ctx->size_customers);
+    ctx->full_checks++;
 
 #if (BANKERS_DEBUG)
     printf("Running bankers algorithm to check for safe sequence\r\n");
 #endif
 
-    while (done < size_customers) {
+    while (done < ctx->size_customers) {
         int found_customer = 0;
-        for (int i = 0; i < size_customers; i++) {
-            if (!finished[i]) {
-                int can_allocate = 1;
-                for (int j = 0; j < size_resources; j++) {
-                    if (customers[i].need[j] > curr_available[j]) {
-                        can_allocate = 0;
-                        break;
-                    }
-                }
-                if (can_allocate) {
+        for (int i = 0; i < ctx->size_customers; i++) {
+            if (!ctx->finished[i]) {
+                if (vec_fits(ctx, ROW(ctx, need, i), ctx->work)) {
 #if (BANKERS_DEBUG)
-                    if (customers[i].initialized)
+                    if (ctx->initialized[i])
                         printf("customer %d is safe\r\n", i);
 #endif
-                    for (int j = 0; j < size_resources; j++) {
-                        curr_available[j] += customers[i].allocation[j];
-                    }
+                    vec_add(ctx, ctx->work, ROW(ctx, allocation, i));
+                    ctx->next_order[done] = i;
                     done++;
                     found_customer = 1;
-                    finished[i] = 1;
+                    ctx->finished[i] = 1;
                 }
             }
         }
@@ -150,9 +351,8 @@ int Bankers_CheckSafeSequence() {
             break;
     }
 
-    Heap_Free(curr_available);
     PD1 ^= 0x02;
-    if (done < size_customers) {
+    if (done < ctx->size_customers) {
 #if (BANKERS_DEBUG)
         printf("Safe sequence does not exist\r\n");
 #endif
@@ -161,123 +361,387 @@ int Bankers_CheckSafeSequence() {
 #if (BANKERS_DEBUG)
         printf("Safe sequence exists\r\n");
 #endif
+        int *order = ctx->safe_order;
+        ctx->safe_order = ctx->next_order;
+        ctx->next_order = order;
+        for (int k = 0; k < ctx->size_customers; k++) {
+            ctx->safe_position[ctx->safe_order[k]] = k;
+        }
+        ctx->safe_valid = 1;
         return BANKERS_OK;
     }
 }
 
-int Bankers_RequestResourcesNonBlocking(int customer, int *request) {
-    if (customer < 0) {
-        customer = OS_Id();
+#if (BANKERS_INCREMENTAL)
+// Helper function to check a granted request against the cached safe sequence.
+// A request of r by the customer at position k takes r out of available and
+// adds it to the customer's allocation, so every customer behind it in the
+// sequence sees the same work vector as before. The customer itself needs r
+// less from r less work. Only the customers ahead of it have to be checked.
+// Releases only add to the work vector, so they never invalidate the sequence.
+// The request must already be applied, the lock of ctx is assumed to be held.
+static int Bankers_CheckSafePrefix(BankersCtx *ctx, int customer) {
+    memcpy(ctx->work, ctx->available, sizeof(vec_t) * ctx->size_words);
+    for (int k = 0; k < ctx->safe_position[customer]; k++) {
+        int ahead = ctx->safe_order[k];
+        if (!vec_fits(ctx, ROW(ctx, need, ahead), ctx->work)) {
+            return BANKERS_UNSAFE;
+        }
+        vec_add(ctx, ctx->work, ROW(ctx, allocation, ahead));
     }
+    ctx->prefix_checks++;
+#if (BANKERS_DEBUG)
+    printf("Cached safe sequence still holds\r\n");
+#endif
+    return BANKERS_OK;
+}
+#endif
 
-    if (request == NULL || customer >= size_customers) {
-        return BANKERS_INVALID;
+// Helper function to grant vec to customer if the state stays safe.
+// vec must fit the customer's need and the available resources. On failure
+// the state is left unchanged. The lock of ctx is assumed to be held.
+static int Bankers_Grant(BankersCtx *ctx, int customer, const vec_t *vec) {
+    vec_sub(ctx, ctx->available, vec);
+    vec_add(ctx, ROW(ctx, allocation, customer), vec);
+    vec_sub(ctx, ROW(ctx, need, customer), vec);
+
+#if (BANKERS_INCREMENTAL)
+    int status = BANKERS_UNSAFE;
+    if (ctx->safe_valid) {
+        status = Bankers_CheckSafePrefix(ctx, customer);
+    }
+    if (status != BANKERS_OK) {
+        // another order may still exist
+        status = Bankers_CheckSafeSequence(ctx);
+    }
+#else
+    int status = Bankers_CheckSafeSequence(ctx);
+#endif
+    if (status != BANKERS_OK) {
+        // Request was not granted, undo changes
+        vec_add(ctx, ctx->available, vec);
+        vec_sub(ctx, ROW(ctx, allocation, customer), vec);
+        vec_add(ctx, ROW(ctx, need, customer), vec);
     }
+    return status;
+}
 
-    OS_bWait(&bankers_lock);
+// Helper function to record that thread tid now holds resources for customer,
+// or with holding 0, that it holds none any more. Threads blocked on a
+// request wait for whoever holds resources, see OS_SemaphoreProducer.
+static void Bankers_Holder(BankersCtx *ctx, int customer, uint32_t tid, int holding) {
+#if (BANKERS_TARGETED_WAKEUP)
+    ctx->thread[customer] = tid;
+    for (int k = ctx->pending_head; k >= 0; k = ctx->pending_next[k]) {
+        OS_SemaphoreProducer(&ctx->wake[k], tid, holding);
+    }
+#else
+    OS_SemaphoreProducer(&ctx->blocked, tid, holding);
+#endif
+}
 
+// Helper function to try num requests as one, all granted or none.
+// Leaves their sum in ctx->scratch. The lock of ctx is assumed to be held.
+static int Bankers_Request(BankersCtx *ctx, int customer, int **requests, int num) {
 #if (BANKERS_DEBUG)
-    printf("Customer %d requesting resources: ", customer);
-    for (int i = 0; i < size_resources; i++) {
-        printf("%d ", request[i]);
+    for (int n = 0; n < num && requests[n] != NULL; n++) {
+        printf("Customer %d requesting resources: ", customer);
+        for (int i = 0; i < ctx->size_resources; i++) {
+            printf("%d ", requests[n][i]);
+        }
+        printf("\r\n");
+    }
+#endif
+
+    Bankers_TraceStart(start);
+    ctx->requests++;
+    int status = vec_pack_sum(ctx, ctx->scratch, requests, num);
+    if (status == BANKERS_OK) {
+        if (vec_fits(ctx, ctx->scratch, ROW(ctx, need, customer)) && vec_fits(ctx, ctx->scratch, ctx->available)) {
+            status = Bankers_Grant(ctx, customer, ctx->scratch);
+        } else {
+            status = BANKERS_UNSAFE;
+        }
+    }
+    Bankers_Trace(ctx, start, customer, BANKERS_EV_REQUEST, ctx->scratch, status);
+    if (status == BANKERS_OK) {
+        Bankers_Holder(ctx, customer, OS_Id(), 1);
+    }
+
+#if (BANKERS_DEBUG)
+    printf("Current available resources: ");
+    for (int i = 0; i < ctx->size_resources; i++) {
+        printf("%d ", vec_get(ctx->available, i));
     }
     printf("\r\n");
 #endif
+    return status;
+}
 
-    for (int i = 0; i < size_resources; i++) {
-        if (request[i] > customers[customer].need[i] || request[i] > available[i]) {
-            OS_bSignal(&bankers_lock);
-            return BANKERS_UNSAFE;
+#if (BANKERS_TARGETED_WAKEUP)
+// Helper function to queue the request in ctx->scratch until a release can
+// grant it. The queue is ordered by thread priority, first come first served
+// within a priority. The lock of ctx is assumed to be held.
+static int Bankers_Unpend(BankersCtx *ctx, int customer);
+
+static void Bankers_Pend(BankersCtx *ctx, int customer) {
+    Bankers_Unpend(ctx, customer);  // left behind by a killed thread with the same id
+    memcpy(ROW(ctx, pending, customer), ctx->scratch, sizeof(vec_t) * ctx->size_words);
+    ctx->thread[customer] = OS_Id();
+    ctx->priority[customer] = OS_Priority();
+
+    // nobody else waits on it, the last grant has been consumed
+    OS_InitSemaphore(&ctx->wake[customer], 0);
+    for (int h = 0; h < ctx->size_customers; h++) {
+        if (vec_any(ctx, ROW(ctx, allocation, h))) {
+            OS_SemaphoreProducer(&ctx->wake[customer], ctx->thread[h], 1);
         }
     }
 
-    for (int i = 0; i < size_resources; i++) {
-        available[i] -= request[i];
-        customers[customer].allocation[i] += request[i];
-        customers[customer].need[i] -= request[i];
+    int *link = &ctx->pending_head;
+    while (*link >= 0 && ctx->priority[*link] <= ctx->priority[customer]) {
+        link = &ctx->pending_next[*link];
     }
+    ctx->pending_next[customer] = *link;
+    *link = customer;
+}
 
-    int status = Bankers_CheckSafeSequence();
-    if (status != BANKERS_OK) {
-        // Request was not granted, undo changes
-        for (int i = 0; i < size_resources; i++) {
-            available[i] += request[i];
-            customers[customer].allocation[i] -= request[i];
-            customers[customer].need[i] += request[i];
+// Helper function to take customer off the queue of blocked requests.
+// Returns 1 if it was queued. The lock of ctx is assumed to be held.
+static int Bankers_Unpend(BankersCtx *ctx, int customer) {
+    for (int *link = &ctx->pending_head; *link >= 0; link = &ctx->pending_next[*link]) {
+        if (*link == customer) {
+            *link = ctx->pending_next[customer];
+            return 1;
         }
     }
+    return 0;
+}
 
+// Helper function to grant queued requests after a release, highest priority
+// first. Requests that do not fit the available resources are skipped without
+// a safety check, the others are granted if the state stays safe, and only
+// their customers are woken. Requests of threads killed while they waited are
+// dropped. The lock of ctx is assumed to be held.
+static void Bankers_WakePending(BankersCtx *ctx) {
+    int *link = &ctx->pending_head;
+    while (*link >= 0) {
+        int k = *link;
+        vec_t *pending = ROW(ctx, pending, k);
+        Bankers_TraceStart(start);
+        if (!OS_ThreadAlive(ctx->thread[k])) {
+            *link = ctx->pending_next[k];
+        } else if (vec_fits(ctx, pending, ROW(ctx, need, k)) && vec_fits(ctx, pending, ctx->available) &&
+            Bankers_Grant(ctx, k, pending) == BANKERS_OK) {
 #if (BANKERS_DEBUG)
-    printf("Current available resources: ");
-    for (int i = 0; i < size_resources; i++) {
-        printf("%d ", available[i]);
+            printf("Customer %d granted on release\r\n", k);
+#endif
+            Bankers_Trace(ctx, start, k, BANKERS_EV_WAKE, pending, BANKERS_OK);
+            *link = ctx->pending_next[k];
+            Bankers_Holder(ctx, k, ctx->thread[k], 1);
+            ctx->wakeups++;
+            OS_Signal(&ctx->wake[k]);
+        } else {
+            link = &ctx->pending_next[k];
+        }
     }
-    printf("\r\n");
+}
 #endif
 
-    OS_bSignal(&bankers_lock);
+int BankersCtx_RequestResourcesNonBlocking(BankersCtx *ctx, int customer, int *request) {
+    if (customer < 0) {
+        customer = OS_Id();
+    }
+
+    if (request == NULL || customer >= ctx->size_customers) {
+        return BANKERS_INVALID;
+    }
+
+    OS_bWait(&ctx->lock);
+    int status = Bankers_Request(ctx, customer, &request, 1);
+    OS_bSignal(&ctx->lock);
     return status;
 }
 
-int Bankers_RequestResourcesBlocking(int customer, int *request) {
+int BankersCtx_RequestBatch(BankersCtx *ctx, int customer, int **requests, int num) {
     if (customer < 0) {
         customer = OS_Id();
     }
 
-    if (request == NULL || customer >= size_customers) {
+    if (requests == NULL || num < 1 || customer >= ctx->size_customers) {
         return BANKERS_INVALID;
     }
 
-    int status = Bankers_RequestResourcesNonBlocking(customer, request);
+#if (BANKERS_TARGETED_WAKEUP)
+    OS_bWait(&ctx->lock);
+    int status = Bankers_Request(ctx, customer, requests, num);
+    if (status == BANKERS_UNSAFE) {
+        Bankers_Pend(ctx, customer);
+    }
+    OS_bSignal(&ctx->lock);
+
+    if (status == BANKERS_UNSAFE) {
+        // granted by the release that woke us, unless deadlock recovery aborted the wait
+        if (OS_WaitTimeout(&ctx->wake[customer], OS_FOREVER) == OS_WAIT_OK) {
+            status = BANKERS_OK;
+        } else {
+            OS_bWait(&ctx->lock);
+            if (Bankers_Unpend(ctx, customer)) {
+                status = BANKERS_ABORTED;
+            } else {
+                OS_Wait(&ctx->wake[customer]);  // a release granted it in the meantime
+                status = BANKERS_OK;
+            }
+            OS_bSignal(&ctx->lock);
+        }
+    }
+#else
+    OS_bWait(&ctx->lock);
+    int status = Bankers_Request(ctx, customer, requests, num);
+    OS_bSignal(&ctx->lock);
     while (status == BANKERS_UNSAFE) {
-        OS_Wait(&blocked);
-        status = Bankers_RequestResourcesNonBlocking(customer, request);
+        OS_Wait(&ctx->blocked);
+        OS_bWait(&ctx->lock);
+        status = Bankers_Request(ctx, customer, requests, num);
+        OS_bSignal(&ctx->lock);
     }
+#endif
 
     return status;
 }
 
-int Bankers_ReleaseResources(int customer, int *release) {
+int BankersCtx_RequestResourcesBlocking(BankersCtx *ctx, int customer, int *request) {
+    if (request == NULL) {
+        return BANKERS_INVALID;
+    }
+    return BankersCtx_RequestBatch(ctx, customer, &request, 1);
+}
+
+int BankersCtx_ReleaseBatch(BankersCtx *ctx, int customer, int **releases, int num) {
     if (customer < 0) {
         customer = OS_Id();
     }
 
-    if (release == NULL || customer >= size_customers) {
+    if (releases == NULL || num < 1 || customer >= ctx->size_customers) {
         return BANKERS_INVALID;
     }
 
-    OS_bWait(&bankers_lock);
+    OS_bWait(&ctx->lock);
 
 #if (BANKERS_DEBUG)
-    printf("Customer %d releasing resources: ", customer);
-    for (int i = 0; i < size_resources; i++) {
-        printf("%d ", release[i]);
+    for (int n = 0; n < num && releases[n] != NULL; n++) {
+        printf("Customer %d releasing resources: ", customer);
+        for (int i = 0; i < ctx->size_resources; i++) {
+            printf("%d ", releases[n][i]);
+        }
+        printf("\r\n");
     }
-    printf("\r\n");
 #endif
 
-    for (int i = 0; i < size_resources; i++) {
-        if (customers[customer].allocation[i] < release[i]) {
-            OS_bSignal(&bankers_lock);
-            return BANKERS_INVALID;
-        }
+    Bankers_TraceStart(start);
+    if (vec_pack_sum(ctx, ctx->scratch, releases, num) != BANKERS_OK ||
+        !vec_fits(ctx, ctx->scratch, ROW(ctx, allocation, customer))) {
+        Bankers_Trace(ctx, start, customer, BANKERS_EV_RELEASE, ctx->scratch, BANKERS_INVALID);
+        OS_bSignal(&ctx->lock);
+        return BANKERS_INVALID;
     }
 
-    for (int i = 0; i < size_resources; i++) {
-        available[i] += release[i];
-        customers[customer].allocation[i] -= release[i];
-        customers[customer].need[i] += release[i];
+    vec_add(ctx, ctx->available, ctx->scratch);
+    vec_sub(ctx, ROW(ctx, allocation, customer), ctx->scratch);
+    vec_add(ctx, ROW(ctx, need, customer), ctx->scratch);
+    ctx->releases++;
+    Bankers_Trace(ctx, start, customer, BANKERS_EV_RELEASE, ctx->scratch, BANKERS_OK);  // wakes are traced on their own
+#if (BANKERS_TARGETED_WAKEUP)
+    Bankers_WakePending(ctx);
+#else
+    OS_SignalAll(&ctx->blocked);
+#endif
+    // after signalling, which counts the caller as a producer again
+    if (!vec_any(ctx, ROW(ctx, allocation, customer))) {
+        Bankers_Holder(ctx, customer, OS_Id(), 0);  // has nothing left to release
     }
-    OS_SignalAll(&blocked);
 
 #if (BANKERS_DEBUG)
     printf("Current available resources: ");
-    for (int i = 0; i < size_resources; i++) {
-        printf("%d ", available[i]);
+    for (int i = 0; i < ctx->size_resources; i++) {
+        printf("%d ", vec_get(ctx->available, i));
     }
     printf("\r\n");
 #endif
-    OS_bSignal(&bankers_lock);
+    OS_bSignal(&ctx->lock);
 
     return BANKERS_OK;
 }
+
+int BankersCtx_ReleaseResources(BankersCtx *ctx, int customer, int *release) {
+    if (release == NULL) {
+        return BANKERS_INVALID;
+    }
+    return BankersCtx_ReleaseBatch(ctx, customer, &release, 1);
+}
+
+void BankersCtx_TraceDump(BankersCtx *ctx) {
+#if (BANKERS_TRACE)
+    static const char *const kinds[] = {"request", "release", "wake"};
+    static const char *const verdicts[] = {"ok", "already init", "malloc error", "invalid", "unsafe", "aborted"};
+    if (ctx->available == NULL) {
+        printf("Banker's domain not initialized\r\n");
+        return;
+    }
+
+    OS_bWait(&ctx->lock);
+    uint32_t count = ctx->trace_count;
+    OS_bSignal(&ctx->lock);
+    uint32_t first = count > BANKERS_TRACE ? count - BANKERS_TRACE : 0;
+    printf("%u Banker's events, last %u, with the cycles each took:\r\n", count, count - first);
+    for (uint32_t n = first; n < count; n++) {
+        // copy one event at a time, printing it under the lock would stall the domain
+        OS_bWait(&ctx->lock);
+        BankersEvent event = ctx->trace[n % BANKERS_TRACE];
+        int overwritten = ctx->trace_count - n > BANKERS_TRACE;
+        OS_bSignal(&ctx->lock);
+        if (!overwritten) {
+            printf("%10u customer %3u %-7s %08x %s\r\n", event.cycles, event.customer, kinds[event.kind], event.hash,
+                   verdicts[event.status]);
+        }
+    }
+#else
+    printf("Banker's trace disabled\r\n");
+#endif
+}
+
+int Bankers_Init(int num_resources, int num_threads, int *available_init) {
+    return BankersCtx_Init(&BankersDefault, num_resources, num_threads, available_init);
+}
+
+int Bankers_InitArena(int num_resources, int num_threads, int *available_init, void *arena, int size) {
+    return BankersCtx_InitArena(&BankersDefault, num_resources, num_threads, available_init, arena, size);
+}
+
+int Bankers_SetMaxDemand(int customer, int *max_demand) {
+    return BankersCtx_SetMaxDemand(&BankersDefault, customer, max_demand);
+}
+
+int Bankers_RequestResourcesNonBlocking(int customer, int *request) {
+    return BankersCtx_RequestResourcesNonBlocking(&BankersDefault, customer, request);
+}
+
+int Bankers_RequestResourcesBlocking(int customer, int *request) {
+    return BankersCtx_RequestResourcesBlocking(&BankersDefault, customer, request);
+}
+
+int Bankers_ReleaseResources(int customer, int *release) {
+    return BankersCtx_ReleaseResources(&BankersDefault, customer, release);
+}
+
+int Bankers_RequestBatch(int customer, int **requests, int num) {
+    return BankersCtx_RequestBatch(&BankersDefault, customer, requests, num);
+}
+
+int Bankers_ReleaseBatch(int customer, int **releases, int num) {
+    return BankersCtx_ReleaseBatch(&BankersDefault, customer, releases, num);
+}
+
+void Bankers_TraceDump(void) {
+    BankersCtx_TraceDump(&BankersDefault);
+}
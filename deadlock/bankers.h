@@ -4,22 +4,160 @@
 #ifndef BANKERS_H
 #define BANKERS_H
 
+#include <stdint.h>
+
+#include "../common/OS.h"
+
+// Customers of a domain set up with num_threads -1, the thread ids below it
+// Every customer costs a row of each matrix, so this is kept apart from
+// MAX_THREADS.
+#ifndef BANKERS_CUSTOMERS
+#define BANKERS_CUSTOMERS 9
+#endif
+
 // Error codes returned by Banker's algorithm functions
 #define BANKERS_OK 0
 #define BANKERS_ALREADY_INIT 1
 #define BANKERS_MALLOC_ERR 2
 #define BANKERS_INVALID 3
 #define BANKERS_UNSAFE 4
+#define BANKERS_ABORTED 5
+
+// Width in bits of one resource count in the Banker's vectors
+// 0 keeps one int per resource, 8 or 16 packs the counts into machine words
+// so the safety check compares and adds several resources per instruction.
+// Packed counts keep their top bit clear, so no resource may have more than
+// BANKERS_MAX_UNITS units. Worth it only for many resources, see
+// bench-bankers-lanes, so counts are not limited by default.
+#ifndef BANKERS_LANE_BITS
+#define BANKERS_LANE_BITS 0
+#endif
+#if (BANKERS_LANE_BITS)
+#define BANKERS_MAX_UNITS ((1 << (BANKERS_LANE_BITS - 1)) - 1)
+typedef unsigned long BankersVec;  // native register width, 32 bits on the target
+#else
+#define BANKERS_MAX_UNITS 0x7FFFFFFF
+typedef int BankersVec;
+#endif
+
+// 1 queues each blocked request and lets a release grant and wake only the
+// customers whose request now fits, 0 wakes every blocked customer to retry
+#ifndef BANKERS_TARGETED_WAKEUP
+#define BANKERS_TARGETED_WAKEUP 1
+#endif
+
+// Number of events kept in each domain's trace ring, a power of two, 0 disables
+// the trace. Recording an event costs a few stores, unlike printing it.
+#ifndef BANKERS_TRACE
+#define BANKERS_TRACE 64
+#endif
+
+// Kinds of Banker's trace events
+#define BANKERS_EV_REQUEST 0  // request or batch tried by its caller
+#define BANKERS_EV_RELEASE 1  // release or batch release
+#define BANKERS_EV_WAKE 2     // queued request granted by a release
+
+// One Banker's trace event, 12 bytes
+struct BankersEvent {
+    uint32_t cycles;   // bus cycles from unpacking the vector to the verdict
+    uint32_t hash;     // hash of the packed request or release vector
+    uint8_t customer;
+    uint8_t kind;      // BANKERS_EV_*
+    uint8_t status;    // BANKERS_OK, BANKERS_UNSAFE or BANKERS_INVALID
+};
+typedef struct BankersEvent BankersEvent;
+
+// One resource domain (e.g. DMA channels, buffer pools)
+// Each domain has its own lock, blocked customers and safety check, so
+// requests in unrelated domains never wait for each other. Customer numbers
+// are local to the domain. Fill in with BankersCtx_Init or BankersCtx_InitArena.
+struct BankersCtx {
+    uint32_t size_resources;
+    uint32_t size_customers;
+    uint32_t size_words;   // BankersVec holding the resource counts
+    uint32_t size_stride;  // BankersVec in each vector, size_words rounded up for alignment
+
+    Sema4Type lock;  // serializes the domain
+#if (!BANKERS_TARGETED_WAKEUP)
+    Sema4Type blocked;  // customers waiting for a release
+#endif
+
+    // All state below lives in one arena carved up by BankersCtx_InitArena
+    BankersVec *available;
+    BankersVec *scratch;  // caller's request, release or demand once packed
+    // Customer x resource matrices, row-major, one row of size_stride per customer
+    // A customer's maximum demand is its need plus its allocation.
+    BankersVec *allocation;
+    BankersVec *need;
+    int8_t *initialized;  // customer has set its maximum demand
+    int8_t *finished;
+
+    // Scratch space of the safety check
+    BankersVec *work;    // available resources while walking a sequence
+    int *safe_order;     // last safe sequence found, customer numbers
+    int *safe_position;  // index of each customer in safe_order
+    int *next_order;     // sequence being built by a full check
+    int8_t safe_valid;   // safe_order describes the current state
+
+#if (BANKERS_TARGETED_WAKEUP)
+    // Blocked requests, one row of the pending matrix per customer
+    Sema4Type *wake;      // per customer, signalled once a release granted its request
+    BankersVec *pending;  // request each blocked customer waits for
+    int *pending_next;    // queue of blocked customers by priority
+    int pending_head;     // first blocked customer, -1 if none
+    uint32_t *thread;     // thread acting for each customer
+    uint32_t *priority;   // priority of each blocked customer
+    uint32_t wakeups;     // requests granted by a release
+#endif
+    uint32_t requests;       // request attempts, retries included
+    uint32_t releases;       // successful Bankers_ReleaseResources calls
+
+    uint32_t full_checks;    // full O(n^2 * m) safety checks run
+    uint32_t prefix_checks;  // requests decided from the cached sequence
+
+#if (BANKERS_TRACE)
+    // Last BANKERS_TRACE events, written under the lock
+    BankersEvent trace[BANKERS_TRACE];
+    uint32_t trace_count;  // events recorded since init, the next goes to trace_count % BANKERS_TRACE
+#endif
+};
+typedef struct BankersCtx BankersCtx;
+
+// The domain used by the Bankers_* functions below
+extern BankersCtx BankersDefault;
 
 // Initializes Banker's algorithm
 // Parameters:
 //   num_resources: Number of resources in the system
-//   num_threads: Number of threads (customers) in the system
-//   available_init: Initial availability of each resource
+//   num_threads: Number of threads (customers) in the system, -1 for BANKERS_CUSTOMERS
+//   available_init: Initial availability of each resource, at most BANKERS_MAX_UNITS
 // Return value:
 //   BANKERS_OK if initialization succeeds, otherwise error code
 int Bankers_Init(int num_resources, int num_threads, int *available_init);
 
+// Returns the memory Banker's algorithm needs, so it can be set aside up front
+// All state lives in one arena: the customer x resource allocation and need
+// matrices, row-major with each row aligned for vector loads, then the
+// available and work vectors and the safe sequence.
+// Parameters:
+//   num_resources: Number of resources in the system
+//   num_threads: Number of threads (customers) in the system, -1 for BANKERS_CUSTOMERS
+// Return value:
+//   Size of the arena in bytes, 0 if num_resources is invalid
+int Bankers_ArenaSize(int num_resources, int num_threads);
+
+// Initializes Banker's algorithm in memory supplied by the caller
+// Bankers_Init does the same with an arena taken from the heap.
+// Parameters:
+//   num_resources: Number of resources in the system
+//   num_threads: Number of threads (customers) in the system, -1 for BANKERS_CUSTOMERS
+//   available_init: Initial availability of each resource, at most BANKERS_MAX_UNITS
+//   arena: Memory for the state, any alignment
+//   size: Size of arena in bytes, at least Bankers_ArenaSize(num_resources, num_threads)
+// Return value:
+//   BANKERS_OK if initialization succeeds, otherwise error code
+int Bankers_InitArena(int num_resources, int num_threads, int *available_init, void *arena, int size);
+
 // Sets the maximum demand of a customer for a resource
 // Parameters:
 //   customer: Customer number (-1 defaults to OS_Id())
@@ -42,7 +180,8 @@ int Bankers_RequestResourcesNonBlocking(int customer, int *request);
 //   customer: Customer number (-1 defaults to OS_Id())
 //   request: Array representing the requested resources
 // Return value:
-//   BANKERS_OK if the request is granted, otherwise error code
+//   BANKERS_OK if the request is granted, BANKERS_ABORTED if deadlock
+//   recovery ended the wait, otherwise error code
 int Bankers_RequestResourcesBlocking(int customer, int *request);
 
 // Releases resources held by a customer
@@ -53,4 +192,42 @@ int Bankers_RequestResourcesBlocking(int customer, int *request);
 //   BANKERS_OK if resources are released successfully, otherwise error code
 int Bankers_ReleaseResources(int customer, int *release);
 
+// Requests several resource vectors at once, blocking
+// They are checked as their sum under one lock acquisition and one safety
+// check, and granted all together or not at all.
+// Parameters:
+//   customer: Customer number (-1 defaults to OS_Id())
+//   requests: Array of num request arrays
+//   num: Number of requests, at least 1
+// Return value:
+//   BANKERS_OK once all requests are granted, BANKERS_ABORTED if deadlock
+//   recovery ended the wait, otherwise error code
+int Bankers_RequestBatch(int customer, int **requests, int num);
+
+// Releases several resource vectors at once, all or none
+// Parameters:
+//   customer: Customer number (-1 defaults to OS_Id())
+//   releases: Array of num release arrays
+//   num: Number of releases, at least 1
+// Return value:
+//   BANKERS_OK if resources are released successfully, otherwise error code
+int Bankers_ReleaseBatch(int customer, int **releases, int num);
+
+// Prints the trace ring, oldest event first
+// Meant for the interpreter, the domain keeps running while the events are
+// printed and any overwritten in the meantime are skipped.
+void Bankers_TraceDump(void);
+
+// Same as the Bankers_* functions above, in the resource domain ctx
+int BankersCtx_Init(BankersCtx *ctx, int num_resources, int num_threads, int *available_init);
+int BankersCtx_InitArena(BankersCtx *ctx, int num_resources, int num_threads, int *available_init, void *arena,
+                         int size);
+int BankersCtx_SetMaxDemand(BankersCtx *ctx, int customer, int *max_demand);
+int BankersCtx_RequestResourcesNonBlocking(BankersCtx *ctx, int customer, int *request);
+int BankersCtx_RequestResourcesBlocking(BankersCtx *ctx, int customer, int *request);
+int BankersCtx_ReleaseResources(BankersCtx *ctx, int customer, int *release);
+int BankersCtx_RequestBatch(BankersCtx *ctx, int customer, int **requests, int num);
+int BankersCtx_ReleaseBatch(BankersCtx *ctx, int customer, int **releases, int num);
+void BankersCtx_TraceDump(BankersCtx *ctx);
+
 #endif  // BANKERS_H
@@ -0,0 +1,274 @@
+// filename ************************OShost.c************************
+// Hosted port of the RTOS kernel, lets common/OS.c run as a Linux process
+// Replaces osasm.s (StartOS, ContextSwitch, PendSV), CortexM.c and the
+// TimerNA drivers used by the kernel.
+
+// Implementation Notes:
+// Each thread is a ucontext coroutine with its own host stack. The NVIC is
+// modelled by a PRIMASK flag plus a set of periodic timer sources. Pending
+// interrupts are delivered at the points where the target would take them,
+// i.e. whenever PRIMASK is cleared (EnableInterrupts/EndCritical) and on
+// WaitForInterrupt. A thread that spins without calling into the kernel is
+// therefore never preempted, which matches how the test threads behave.
+// The virtual clock counts 12.5ns bus cycles. It follows host time while
+// code runs, so OS_Time measurements reflect real execution cost, and it
+// jumps straight to the next timer deadline when the idle thread waits.
+
+#include "../host/OShost.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+
+#include "../common/heap.h"
+#include "../inc/CortexM.h"
+
+extern TCB *RunPt;
+extern TCB *NextPt;
+extern uint32_t num_created;
+extern uint32_t num_killed;
+extern uint32_t SumCritical;
+extern uint32_t MaxCritical;
+
+struct HostContext {
+    ucontext_t uc;
+    void (*task)(void);
+};
+typedef struct HostContext HostContext;
+
+struct HostTimer {
+    void (*task)(void);
+    uint64_t period;    // bus cycles, 0 means disarmed
+    uint64_t deadline;  // virtual time of the next interrupt
+    uint32_t calls;
+    uint64_t busy;     // total bus cycles spent in the handler
+    uint64_t maxBusy;  // worst case bus cycles spent in the handler
+};
+typedef struct HostTimer HostTimer;
+
+static const char *const TimerNames[HOST_NUM_TIMERS] = {
+    "Timer0A", "Timer1A", "Timer2A", "Timer3A", "Timer4A", "SysTick"};
+static HostTimer Timers[HOST_NUM_TIMERS];
+
+static long Primask = 1;  // 1 means interrupts are disabled
+static int InISR = 0;     // handlers run to completion, no nesting
+static int PendSV = 0;    // context switch requested
+
+static uint64_t StartNs;    // host time at Host_Init
+static uint64_t Skipped;    // bus cycles fast-forwarded while idle
+static uint64_t EndCycles;  // virtual time at which the scenario ends
+static uint32_t NumSwitches;
+
+static uint64_t HostNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t Host_Cycles(void) {
+    // 80 MHz bus, 12.5ns per cycle
+    return (HostNs() - StartNs) * 2 / 25 + Skipped;
+}
+
+int Host_InHandler(void) {
+    return InISR;
+}
+
+uint32_t Host_ContextSwitches(void) {
+    return NumSwitches;
+}
+
+void Host_SetRunTime(uint32_t ms) {
+    EndCycles = (uint64_t)ms * TIME_1MS;
+}
+
+static void Host_Report(void) {
+    uint64_t cycles = Host_Cycles();
+    printf("\n==== Host report ====\n");
+    printf("virtual time: %llu ms (%llu ms idle skipped)\n",
+           (unsigned long long)(cycles / TIME_1MS), (unsigned long long)(Skipped / TIME_1MS));
+    printf("threads created: %u, killed: %u, context switches: %u\n",
+           num_created, num_killed, NumSwitches);
+    printf("critical sections: max %u cycles, total %u cycles\n", MaxCritical, SumCritical);
+    for (int i = 0; i < HOST_NUM_TIMERS; i++) {
+        if (Timers[i].calls > 0) {
+            printf("%-8s %8u calls, avg %6llu cycles, max %6llu cycles\n", TimerNames[i], Timers[i].calls,
+                   (unsigned long long)(Timers[i].busy / Timers[i].calls), (unsigned long long)Timers[i].maxBusy);
+        }
+    }
+    Heap_Dump();
+    OS_StackDump();
+}
+
+// Returns the armed timer with the earliest deadline, NULL if none
+static HostTimer *Host_NextTimer(void) {
+    HostTimer *next = NULL;
+    for (int i = 0; i < HOST_NUM_TIMERS; i++) {
+        if (Timers[i].period != 0 && (next == NULL || Timers[i].deadline < next->deadline)) {
+            next = &Timers[i];
+        }
+    }
+    return next;
+}
+
+static void Host_PendSV(void) {
+    TCB *old = RunPt;
+    PendSV = 0;
+    RunPt = NextPt;
+    if (old != RunPt) {
+        NumSwitches++;
+        swapcontext(&((HostContext *)old->context)->uc, &((HostContext *)RunPt->context)->uc);
+    }
+}
+
+// Takes every interrupt that became due, then the pending context switch
+static void Host_Poll(void) {
+    if (Primask || InISR) {
+        return;
+    }
+    uint64_t now = Host_Cycles();
+    if (EndCycles != 0 && now >= EndCycles) {
+        Primask = 1;  // no more interrupts, the report's critical sections must not poll again
+        Host_Report();
+        exit(0);
+    }
+    HostTimer *timer = Host_NextTimer();
+    while (timer != NULL && timer->deadline <= now) {
+        timer->deadline += timer->period;
+        InISR = 1;
+        uint64_t start = Host_Cycles();
+        timer->task();
+        uint64_t busy = Host_Cycles() - start;
+        InISR = 0;
+        timer->calls++;
+        timer->busy += busy;
+        if (busy > timer->maxBusy) {
+            timer->maxBusy = busy;
+        }
+        timer = Host_NextTimer();
+    }
+    if (PendSV) {
+        Host_PendSV();
+    }
+}
+
+static void Host_TimerInit(int timer, void (*task)(void), uint64_t period) {
+    Timers[timer].task = task;
+    Timers[timer].period = period;
+    Timers[timer].deadline = Host_Cycles() + period;
+}
+
+void Host_Init(void) {
+    StartNs = HostNs();
+    Skipped = 0;
+    NumSwitches = 0;
+    Primask = 1;
+    for (int i = 0; i < HOST_NUM_TIMERS; i++) {
+        Timers[i] = (HostTimer){0};
+    }
+}
+
+static void Host_ThreadEntry(void) {
+    ((HostContext *)RunPt->context)->task();
+    OS_Kill();  // same as returning into the LR set up on the target
+}
+
+void Host_InitContext(TCB *thread, void (*task)(void)) {
+    // The context of a dead thread is recycled, it can never run again
+    HostContext *ctx = thread->context;
+    if (ctx == NULL) {
+        ctx = malloc(sizeof(HostContext) + HOST_STACK_BYTES);
+        if (ctx == NULL) {
+            fprintf(stderr, "out of memory for thread stacks\n");
+            exit(1);
+        }
+        thread->context = ctx;
+    }
+#if (STACK_CHECK)
+    uint32_t *stack = Host_StackBottom(thread);
+    for (uint32_t i = 0; i < HOST_STACK_BYTES / 4; i++) {
+        stack[i] = STACK_CANARY;
+    }
+#endif
+    getcontext(&ctx->uc);
+    ctx->uc.uc_stack.ss_sp = ctx + 1;
+    ctx->uc.uc_stack.ss_size = HOST_STACK_BYTES;
+    ctx->uc.uc_link = NULL;
+    makecontext(&ctx->uc, Host_ThreadEntry, 0);
+    ctx->task = task;
+}
+
+uint32_t *Host_StackBottom(TCB *thread) {
+    return (uint32_t *)((HostContext *)thread->context + 1);
+}
+
+void Host_SysTickInit(void (*task)(void), uint32_t period) {
+    Host_TimerInit(HOST_SYSTICK, task, period);
+}
+
+//******** osasm.s ***************
+
+void StartOS(void) {
+    Primask = 0;
+    setcontext(&((HostContext *)RunPt->context)->uc);
+}
+
+void ContextSwitch(void) {
+    PendSV = 1;
+    Host_Poll();
+}
+
+//******** CortexM.c ***************
+
+void DisableInterrupts(void) {
+    Primask = 1;
+}
+
+void EnableInterrupts(void) {
+    Primask = 0;
+    Host_Poll();
+}
+
+long StartCritical(void) {
+    long sr = Primask;
+    Primask = 1;
+    return sr;
+}
+
+void EndCritical(long sr) {
+    Primask = sr;
+    Host_Poll();
+}
+
+void WaitForInterrupt(void) {
+    // Nothing else can happen until the next interrupt, so skip ahead to it
+    HostTimer *next = Host_NextTimer();
+    uint64_t now = Host_Cycles();
+    if (next != NULL && next->deadline > now) {
+        Skipped += next->deadline - now;
+    }
+    Host_Poll();
+}
+
+//******** TimerNA.c ***************
+
+void Timer0A_Init(void (*task)(void), uint32_t period, uint32_t priority) {
+    Host_TimerInit(0, task, period);
+}
+
+void Timer1A_Init(void (*task)(void), uint32_t period, uint32_t priority) {
+    Host_TimerInit(1, task, period);
+}
+
+void Timer2A_Init(void (*task)(void), uint32_t period, uint32_t priority) {
+    Host_TimerInit(2, task, period);
+}
+
+void Timer3A_Init(void (*task)(void), uint32_t period, uint32_t priority) {
+    Host_TimerInit(3, task, period);
+}
+
+void Timer4A_Init(void (*task)(void), uint32_t period, uint32_t priority) {
+    Host_TimerInit(4, task, period);
+}
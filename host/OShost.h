@@ -0,0 +1,53 @@
+// filename ************************OShost.h************************
+// Hosted port of the RTOS kernel, lets common/OS.c run as a Linux process
+// Threads are ucontext coroutines, interrupts are simulated by a virtual
+// clock in 12.5ns bus cycles that follows host time while threads run
+// and fast-forwards to the next timer deadline when the CPU idles.
+// Build with OS_HOSTED=1, see host/Makefile
+
+#ifndef OSHOST_H
+#define OSHOST_H
+
+#include <stdint.h>
+
+#include "../common/OS.h"
+
+// Number of timer interrupt sources the host can simulate (Timer0A-4A and SysTick)
+#define HOST_NUM_TIMERS 6
+#define HOST_SYSTICK 5
+
+// Size of the host stack given to each thread, target stacks are far too small for libc
+#define HOST_STACK_BYTES (64 * 1024)
+
+// Initializes the simulated interrupt controller and virtual clock
+// Interrupts are disabled until OS_Launch, same as the target
+void Host_Init(void);
+
+// Builds the execution context for a new thread, called by OS_AddThread
+// in place of building the initial stack frame in the stack arena
+// Input: TCB of the new thread, thread entry point (OS_Kill is called if it returns)
+// The host stack is painted with STACK_CANARY when STACK_CHECK is set
+void Host_InitContext(TCB *thread, void (*task)(void));
+
+// Returns the lowest word of the host stack of a thread, HOST_STACK_BYTES long
+// Input: TCB of a thread added since OS_Init
+uint32_t *Host_StackBottom(TCB *thread);
+
+// Arms the simulated SysTick used for preemption
+// Input: handler, time slice in 12.5ns units
+void Host_SysTickInit(void (*task)(void), uint32_t period);
+
+// Returns 1 while a simulated interrupt handler runs, 0 in thread context
+int Host_InHandler(void);
+
+// Returns the number of context switches since Host_Init
+uint32_t Host_ContextSwitches(void);
+
+// Returns the virtual clock in 12.5ns bus cycles
+uint64_t Host_Cycles(void);
+
+// Sets how long (virtual ms) a launched scenario runs before the
+// process exits and prints its report, 0 runs forever
+void Host_SetRunTime(uint32_t ms);
+
+#endif  // OSHOST_H
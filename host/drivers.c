@@ -0,0 +1,53 @@
+// filename ************************drivers.c************************
+// Host stand-ins for the LaunchPad peripherals used by the deadlock project
+// UART goes to stdin/stdout, the LCD is echoed to stdout only when the
+// OS_HOST_LCD environment variable is set, everything else does nothing.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../common/OS.h"
+#include "../common/ST7735.h"
+#include "../common/UART0int.h"
+#include "../inc/LaunchPad.h"
+#include "../inc/PLL.h"
+
+void PLL_Init(uint32_t freq) {}
+
+void LaunchPad_Init(void) {}
+
+void UART_Init(void) {}
+
+char UART_InChar(void) {
+    return getchar();
+}
+
+void UART_OutChar(char data) {
+    putchar(data);
+}
+
+void UART_OutString(char *pt) {
+    fputs(pt, stdout);
+}
+
+void UART_OutUDec(uint32_t n) {
+    printf("%u", n);
+}
+
+static int LCDEcho = 0;
+
+void ST7735_InitR(enum initRFlags option) {
+    LCDEcho = (getenv("OS_HOST_LCD") != NULL);
+}
+
+void ST7735_Message(uint32_t d, uint32_t l, char *pt, int32_t value) {
+    if (LCDEcho) {
+        printf("[lcd %u:%u] %s%d\n", d, l, pt, value);
+    }
+}
+
+// There is no serial console on the host, the shell thread just exits
+void Interpreter(void) {
+    OS_Kill();
+}